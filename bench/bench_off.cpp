@@ -0,0 +1,14 @@
+// teflib/bench/bench_off.cpp
+//
+// Built without USE_TEF so the trace macros compile out: this is the
+// baseline teflib_bench compares against.
+
+#include "trace.h"
+
+void context_off_loop(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        TRACE_CONTEXT("bench", "bench");
+        // keep the loop (the work it stands for) from being optimized away
+        __asm__ __volatile__ ("" ::: "memory");
+    }
+}
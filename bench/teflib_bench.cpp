@@ -0,0 +1,498 @@
+// teflib/bench/teflib_bench.cpp
+//
+// Microbenchmarks of what teflib costs the instrumented program:
+//   - ns per TRACE_CONTEXT with USE_TEF off, tracing idle (no consumer),
+//     its category disabled while others record, and recording (a
+//     consumer with the harvester running), and the idle overhead: idle
+//     minus USE_TEF off
+//   - ns per add_event_with_args() and set_counter() while recording
+//   - advance_consumers() throughput in events/sec and bytes/sec, also
+//     with serialization split across threads (set_serializer_threads())
+//   - ns per tiny task for example/util's Thread_pool::enqueue() and
+//     Work_stealing_pool::submit(), submitted from one thread (tracing idle)
+// each on 1, 2, 4 ... --threads threads.  First it checks that exported
+// scopes still nest on each thread, that the Clock's ticks (counter and
+// steady_clock fallback) increase and keep time, that binary traces written in one
+// unit from batches in the other convert back to the same events and that
+// an event full of typed args keeps its JSON args, and fails otherwise.
+//
+// usage: teflib_bench [--threads N] [--iterations N]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+#include "util/thread_pool.h"
+#include "util/work_stealing_pool.h"
+
+void context_off_loop(uint64_t iterations); // bench_off.cpp
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Null_consumer takes JSON batches and throws them away
+class Null_consumer : public tef::Tracer::Consumer {
+public:
+    Null_consumer() : tef::Tracer::Consumer(10 * tef::MSEC_PER_SECOND) { }
+    void consume_batch(const tef::Tracer::Batch& batch) final override {
+        _bytes += batch.size;
+        _events += batch.num_events;
+    }
+    uint64_t get_bytes() const { return _bytes; }
+    uint64_t get_events() const { return _events; }
+private:
+    uint64_t _bytes { 0 };
+    uint64_t _events { 0 };
+};
+
+// Nesting_check collects the Complete events of each thread and counts
+// those which overlap another without nesting in it
+class Nesting_check : public tef::Tracer::Consumer {
+public:
+    Nesting_check() : tef::Tracer::Consumer(10 * tef::MSEC_PER_SECOND, RAW) { }
+    void consume_raw(const tef::Tracer::Raw_batch& batch) final override {
+        size_t begin = 0;
+        for (size_t i = 0; i < batch.num_ranges; ++i) {
+            std::vector<Scope>& scopes = _scopes[batch.strings[batch.ranges[i].tid]];
+            for (size_t j = begin; j < batch.ranges[i].end; ++j) {
+                const tef::Tracer::Event& event = batch.events[j];
+                if (event.ph == tef::Phase::Complete) {
+                    scopes.push_back({event.ts, event.ts + event.dur});
+                }
+            }
+            begin = batch.ranges[i].end;
+        }
+    }
+    size_t count_overlaps() {
+        size_t overlaps = 0;
+        for (auto& thread : _scopes) {
+            std::vector<Scope>& scopes = thread.second;
+            std::sort(scopes.begin(), scopes.end(), [](const Scope& a, const Scope& b) {
+                return a.begin != b.begin ? a.begin < b.begin : a.end > b.end;
+            });
+            std::vector<uint64_t> open_ends;
+            for (const Scope& scope : scopes) {
+                while (!open_ends.empty() && open_ends.back() <= scope.begin) {
+                    open_ends.pop_back();
+                }
+                if (!open_ends.empty() && scope.end > open_ends.back()) {
+                    ++overlaps;
+                }
+                open_ends.push_back(scope.end);
+            }
+        }
+        return overlaps;
+    }
+private:
+    struct Scope {
+        uint64_t begin;
+        uint64_t end;
+    };
+    std::map<std::string, std::vector<Scope>> _scopes;
+};
+
+// Args_check keeps the args of the last event named name
+class Args_check : public tef::Tracer::Consumer {
+public:
+    explicit Args_check(const std::string& name) : tef::Tracer::Consumer(10 * tef::MSEC_PER_SECOND, RAW),
+        _name(name) { }
+    void consume_raw(const tef::Tracer::Raw_batch& batch) final override {
+        for (size_t i = 0; i < batch.num_events; ++i) {
+            const tef::Tracer::Event& event = batch.events[i];
+            if (batch.strings[event.name] != _name) {
+                continue;
+            }
+            args.assign(batch.args + event.args_begin, batch.args + event.args_begin + event.num_args);
+            text.clear();
+            for (const tef::Arg& arg : args) {
+                if (arg.type == tef::Arg::JSON) {
+                    text.append(batch.text + arg.value.text.offset, arg.value.text.size);
+                }
+            }
+        }
+    }
+    std::vector<tef::Arg> args;
+    std::string text; // of JSON args
+private:
+    std::string _name;
+};
+
+// run_threads() runs body(iterations) on num_threads threads at once and
+// returns the mean nsec per iteration
+double run_threads(size_t num_threads, uint64_t iterations, const std::function<void(uint64_t)>& body) {
+    std::atomic<size_t> ready { 0 };
+    std::atomic<bool> go { false };
+    std::vector<double> nsec(num_threads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t] {
+            ++ready;
+            while (!go.load()) { }
+            Clock::time_point start = Clock::now();
+            body(iterations);
+            nsec[t] = (double)(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+        });
+    }
+    while (ready.load() < num_threads) { }
+    go = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double total = 0.0;
+    for (double n : nsec) {
+        total += n;
+    }
+    return total / (double)(num_threads * iterations);
+}
+
+void context_loop(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        TRACE_CONTEXT("bench", "bench");
+        __asm__ __volatile__ ("" ::: "memory");
+    }
+}
+
+// nested_loop() records 15 scopes nested four deep per iteration, with an
+// instant event in each innermost one
+void nested_scopes(uint32_t depth) {
+    TRACE_CONTEXT("nested", "bench");
+    if (depth > 0) {
+        nested_scopes(depth - 1);
+        nested_scopes(depth - 1);
+    } else {
+        tef::Tracer::instance().add_event("nested_instant", "bench", tef::Phase::Instant);
+    }
+}
+
+void nested_loop(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        nested_scopes(3);
+    }
+}
+
+void add_event_with_args_loop(uint64_t iterations) {
+    tef::Tracer& tracer = tef::Tracer::instance();
+    tef::String_id key = tracer.intern("i");
+    for (uint64_t i = 0; i < iterations; ++i) {
+        tef::Arg arg = tef::make_arg(key, i);
+        tracer.add_event_with_args("bench_args", "bench", tef::Phase::Instant, &arg, 1);
+    }
+}
+
+void set_counter_loop(uint64_t iterations) {
+    tef::Tracer& tracer = tef::Tracer::instance();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        tracer.set_counter("bench_counter", "bench", (int64_t)i);
+    }
+}
+
+void print_ns(const char* name, size_t num_threads, double ns) {
+    printf("%-40s %8zu %12.1f\n", name, num_threads, ns);
+}
+
+// recording runs body with a consumer (of categories, if given) and the
+// harvester draining events
+double run_recording(size_t num_threads, uint64_t iterations, const std::function<void(uint64_t)>& body,
+        const char* categories = nullptr) {
+    tef::Tracer& tracer = tef::Tracer::instance();
+    Null_consumer consumer;
+    if (categories) {
+        consumer.set_categories(categories);
+    }
+    tracer.start_harvester(10);
+    tracer.add_consumer(&consumer);
+    double ns = run_threads(num_threads, iterations, body);
+    tracer.shutdown();
+    return ns;
+}
+
+// check_nesting() records nested scopes, harvesting as it goes, and
+// returns how many exported scopes overlap without nesting
+size_t check_nesting(size_t num_threads, uint64_t iterations) {
+    tef::Tracer& tracer = tef::Tracer::instance();
+    Nesting_check check;
+    tracer.start_harvester(1);
+    tracer.add_consumer(&check);
+    run_threads(num_threads, iterations, nested_loop);
+    tracer.shutdown();
+    return check.count_overlaps();
+}
+
+// check_clock() reads a Clock with (use_counter) or without its counter on
+// each thread and returns how many reads went backwards, plus one if its
+// time since creation is off from steady_clock's by over 1%
+size_t check_clock(bool use_counter, size_t num_threads, uint64_t iterations) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    tef::Clock clock(use_counter);
+    std::atomic<size_t> failures { 0 };
+    run_threads(num_threads, iterations, [&clock, &failures](uint64_t n) {
+        uint64_t last_ticks = clock.ticks();
+        uint64_t last_nsec = clock.to_nsec(last_ticks);
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t ticks = clock.ticks();
+            uint64_t nsec = clock.to_nsec(ticks);
+            if (ticks < last_ticks || nsec < last_nsec) {
+                ++failures;
+            }
+            last_ticks = ticks;
+            last_nsec = nsec;
+        }
+    });
+    uint64_t nsec = clock.to_nsec(clock.ticks());
+    double steady_nsec = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    if (std::abs((double)nsec - steady_nsec) > 0.01 * steady_nsec) {
+        ++failures;
+    }
+    return failures;
+}
+
+// check_binary_units() encodes a batch of Complete, async and flow events
+// in the other unit (usec or nsec) and returns how many of them don't
+// convert back from the binary trace as they were
+size_t check_binary_units(uint64_t batch_units_per_second, uint64_t binary_units_per_second) {
+    const std::string strings[] = { "", "bench", "scope", "request", "hop" };
+    uint64_t scale = batch_units_per_second / tef::USEC_PER_SECOND;
+    tef::Tracer::Event events[] = {
+        { 10 * scale, { 5 * scale }, 2, 1, 0, 0, tef::Phase::Complete, 0 },
+        { 11 * scale, { 0x123456789abcULL }, 3, 1, 0, 0, tef::Phase::AsyncNestableStart, 0 },
+        { 12 * scale, { 7 }, 4, 1, 0, 0, tef::Phase::FlowStart, 0 },
+        { 13 * scale, { 7 }, 4, 1, 0, 0, tef::Phase::FlowEnd, 0 },
+        { 14 * scale, { 0x123456789abcULL }, 3, 1, 0, 0, tef::Phase::AsyncNestableEnd, 0 }
+    };
+    const char* expected[] = {
+        "\"ph\":\"X\",\"ts\":10,\"dur\":5,",
+        "\"ph\":\"b\",\"ts\":11,\"id\":\"0x123456789abc\",",
+        "\"ph\":\"s\",\"ts\":12,\"id\":\"0x7\",",
+        "\"ph\":\"f\",\"ts\":13,\"id\":\"0x7\",",
+        "\"ph\":\"e\",\"ts\":14,\"id\":\"0x123456789abc\","
+    };
+    tef::Tracer::Thread_range range = { 0, sizeof(events) / sizeof(events[0]) };
+    tef::Tracer::Raw_batch batch = {
+        events, range.end, &range, 1, nullptr, nullptr,
+        strings, sizeof(strings) / sizeof(strings[0]),
+        batch_units_per_second, nullptr
+    };
+    tef::Binary_encoder encoder(binary_units_per_second);
+    std::string binary;
+    encoder.append_header(binary);
+    encoder.append_strings(batch, binary);
+    encoder.append_events(batch, binary);
+    encoder.append_end(binary);
+    std::istringstream in(binary);
+    std::ostringstream out;
+    size_t failures = range.end;
+    if (tef::convert_binary_trace(in, out)) {
+        std::string json = out.str();
+        for (const char* event : expected) {
+            if (json.find(event) != std::string::npos) {
+                --failures;
+            }
+        }
+    }
+    return failures;
+}
+
+// check_full_args() records an event with as many typed args as an event
+// keeps plus JSON args and returns how many of its args are not exported
+// as expected: all but the last typed arg (which is dropped), then the JSON
+size_t check_full_args() {
+    constexpr uint32_t MAX_EVENT_ARGS = 255;
+    tef::Tracer& tracer = tef::Tracer::instance();
+    Args_check check("full_args");
+    tracer.add_consumer(&check);
+    uint64_t args_dropped = tracer.get_stats().args_dropped;
+    tef::String_id key = tracer.intern("i");
+    std::vector<tef::Arg> args;
+    for (uint32_t i = 0; i < MAX_EVENT_ARGS; ++i) {
+        args.push_back(tef::make_arg(key, (int64_t)(i)));
+    }
+    tracer.add_event_with_args(tracer.intern("full_args"), tracer.intern("bench"), tef::Phase::Instant,
+            args.data(), (uint32_t)(args.size()), "{\"json\":1}");
+    tracer.shutdown();
+    size_t failures = MAX_EVENT_ARGS + 1;
+    if (check.args.size() == MAX_EVENT_ARGS) {
+        for (uint32_t i = 0; i + 1 < MAX_EVENT_ARGS; ++i) {
+            const tef::Arg& arg = check.args[i];
+            if (arg.type == tef::Arg::INT && arg.key == key && arg.value.i == (int64_t)(i)) {
+                --failures;
+            }
+        }
+        if (check.args.back().type == tef::Arg::JSON && check.text == "\"json\":1") {
+            --failures;
+        }
+    }
+    if (tracer.get_stats().args_dropped == args_dropped + 1) {
+        --failures;
+    }
+    return failures;
+}
+
+void print_failures(const char* name, size_t num_threads, size_t failures) {
+    printf("%-40s %8zu %12zu\n", name, num_threads, failures);
+}
+
+void bench_throughput(const char* name, size_t num_threads, uint64_t num_events) {
+    // record everything first, then time one harvest of it all
+    tef::Tracer& tracer = tef::Tracer::instance();
+    Null_consumer consumer;
+    tracer.add_consumer(&consumer);
+    run_threads(num_threads, num_events / num_threads, [](uint64_t iterations) {
+        tef::Tracer& tracer = tef::Tracer::instance();
+        tef::String_id key = tracer.intern("i");
+        for (uint64_t i = 0; i < iterations; ++i) {
+            TRACE_CONTEXT("bench", "bench");
+            tef::Arg arg = tef::make_arg(key, i);
+            tracer.add_event_with_args("bench_args", "bench", tef::Phase::Instant, &arg, 1);
+        }
+    });
+    Clock::time_point start = Clock::now();
+    tracer.advance_consumers();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    printf("%-40s %8zu %12.2f %12.1f\n", name, num_threads,
+        (double)(consumer.get_events()) / seconds * 1.0e-6,
+        (double)(consumer.get_bytes()) / seconds * 1.0e-6);
+    tracer.shutdown();
+}
+
+void submit_task(Thread_pool& pool, std::atomic<uint64_t>& done) {
+    pool.enqueue([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+}
+
+void submit_task(Work_stealing_pool& pool, std::atomic<uint64_t>& done) {
+    pool.submit([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+}
+
+// run_pool() has num_workers workers run iterations tasks, submitted from
+// this thread, and returns the mean nsec per task
+template <class Pool>
+double run_pool(size_t num_workers, uint64_t iterations) {
+    Pool pool(num_workers);
+    std::atomic<uint64_t> done { 0 };
+    Clock::time_point start = Clock::now();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        submit_task(pool, done);
+    }
+    while (done.load(std::memory_order_relaxed) < iterations) {
+        std::this_thread::yield();
+    }
+    double nsec = (double)(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    return nsec / (double)(iterations);
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+    size_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    uint64_t iterations = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = std::max(atoll(argv[++i]), 1LL);
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--iterations N]\n", argv[0]);
+            return 1;
+        }
+    }
+    std::vector<size_t> thread_counts;
+    for (size_t n = 1; n < max_threads; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(max_threads);
+
+    TRACE_PROCESS("teflib_bench");
+    size_t failures = 0;
+    printf("%-40s %8s %12s\n", "check", "threads", "failures");
+    for (size_t n : thread_counts) {
+        size_t overlaps = check_nesting(n, std::max(iterations / 16, (uint64_t)(1)));
+        print_failures("scopes nest", n, overlaps);
+        failures += overlaps;
+    }
+    for (size_t n : thread_counts) {
+        size_t counter_failures = check_clock(true, n, iterations);
+        print_failures(tef::Clock::has_invariant_counter() ? "clock ticks increase" :
+                "clock ticks increase (no invariant TSC)", n, counter_failures);
+        size_t steady_failures = check_clock(false, n, iterations);
+        print_failures("steady_clock fallback ticks increase", n, steady_failures);
+        failures += counter_failures + steady_failures;
+    }
+    size_t nsec_failures = check_binary_units(tef::USEC_PER_SECOND, tef::NSEC_PER_SECOND);
+    print_failures("binary usec events in nsec trace", 1, nsec_failures);
+    size_t usec_failures = check_binary_units(tef::NSEC_PER_SECOND, tef::USEC_PER_SECOND);
+    print_failures("binary nsec events in usec trace", 1, usec_failures);
+    failures += nsec_failures + usec_failures;
+    size_t args_failures = check_full_args();
+    print_failures("typed and JSON args of a full event", 1, args_failures);
+    failures += args_failures;
+
+    printf("\n%-40s %8s %12s\n", "benchmark", "threads", "ns/op");
+    std::vector<double> off_ns;
+    for (size_t n : thread_counts) {
+        off_ns.push_back(run_threads(n, iterations, context_off_loop));
+        print_ns("TRACE_CONTEXT (USE_TEF off)", n, off_ns.back());
+    }
+    std::vector<double> idle_ns;
+    for (size_t n : thread_counts) {
+        idle_ns.push_back(run_threads(n, iterations, context_loop));
+        print_ns("TRACE_CONTEXT (no consumer)", n, idle_ns.back());
+    }
+    for (size_t n : thread_counts) {
+        print_ns("TRACE_CONTEXT (category disabled)", n, run_recording(n, iterations, context_loop, "other"));
+    }
+    for (size_t i = 0; i < thread_counts.size(); ++i) {
+        print_ns("idle overhead (no consumer - off)", thread_counts[i], idle_ns[i] - off_ns[i]);
+    }
+    for (size_t n : thread_counts) {
+        print_ns("TRACE_CONTEXT (recording)", n, run_recording(n, iterations, context_loop));
+    }
+    for (size_t n : thread_counts) {
+        print_ns("add_event_with_args() (recording)", n, run_recording(n, iterations, add_event_with_args_loop));
+    }
+    for (size_t n : thread_counts) {
+        print_ns("set_counter() (recording)", n, run_recording(n, iterations, set_counter_loop));
+    }
+
+    printf("\n%-40s %8s %12s %12s\n", "benchmark", "threads", "Mevents/s", "MB/s");
+    for (size_t n : thread_counts) {
+        bench_throughput("advance_consumers()", n, iterations);
+    }
+    // as above, serialized on as many threads as record
+    for (size_t n : thread_counts) {
+        if (n > 1) {
+            tef::Tracer::instance().set_serializer_threads((uint32_t)n, 0);
+            bench_throughput("advance_consumers() (parallel)", n, iterations);
+        }
+    }
+    tef::Tracer::instance().set_serializer_threads(0);
+
+    printf("\n%-40s %8s %12s\n", "benchmark", "workers", "ns/task");
+    uint64_t num_tasks = std::max(iterations / 10, (uint64_t)(1));
+    for (size_t n : thread_counts) {
+        print_ns("Thread_pool::enqueue()", n, run_pool<Thread_pool>(n, num_tasks));
+    }
+    for (size_t n : thread_counts) {
+        print_ns("Work_stealing_pool::submit()", n, run_pool<Work_stealing_pool>(n, num_tasks));
+    }
+
+    tef::Tracer::Stats stats = tef::Tracer::instance().get_stats();
+    printf("\n%llu events harvested in %llu harvests (%.1f msec, max %.1f msec), %llu bytes serialized\n",
+        (unsigned long long)stats.events_harvested,
+        (unsigned long long)stats.harvests,
+        (double)stats.harvest_nsec * 1.0e-6,
+        (double)stats.max_harvest_nsec * 1.0e-6,
+        (unsigned long long)stats.bytes_serialized);
+    return failures > 0 ? 1 : 0;
+}
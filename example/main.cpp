@@ -10,6 +10,12 @@
 // #!bash
 // PID=./teflib_example
 // kill --SIGUSR2 $PID
+//
+// When run with --flight-recorder the example instead traces all the time
+// into fixed-size per-thread rings and SIGUSR2 saves the last few seconds.
+//
+// When run with --harvester events are harvested on a Tracer thread
+// instead of in the mainloop.
 
 #include <algorithm>
 #include <chrono>
@@ -33,6 +39,7 @@
 bool g_running = false;
 int32_t g_num_exit_signals = 0;
 int32_t g_exit_value = 0;
+bool g_flight_recorder = false;
 
 TRACE_GLOBAL_INIT
 
@@ -72,6 +79,19 @@ void exit_handler(int32_t signum ) {
 
 void trace_handler(int32_t signum) {
     // g_trace_consumer was created in TRACE_GLOBAL_INIT
+    if (g_flight_recorder) {
+        // in flight recorder mode events are always being recorded
+        // so we just ask for a snapshot of the most recent ones
+        if (!g_trace_consumer) {
+            constexpr uint64_t SNAPSHOT_WINDOW = 5 * timing_util::MSEC_PER_SECOND;
+            std::string timestamp = timing_util::get_local_datetime_string(timing_util::get_now_msec());
+            std::string filename = fmt::format("/tmp/{}-snapshot.json", timestamp);
+            LOG("SNAPSHOT trace file={} window={}msec\n", filename, SNAPSHOT_WINDOW);
+            g_trace_consumer = std::make_unique<tef::Trace_to_file>(SNAPSHOT_WINDOW, filename);
+            tef::Tracer::instance().request_snapshot(g_trace_consumer.get(), SNAPSHOT_WINDOW);
+        }
+        return;
+    }
     if (!g_trace_consumer) {
         // we don't yet have a consumer,
         // so we create one and add it to the Tracer
@@ -138,7 +158,7 @@ void run_side_thread() {
         // add an 'arg' to the current trace context
         // this is just an example of how to make details
         // visible to the chrome://tracing browser
-        TRACE_CONTEXT_ARGS("\"data_size\":{}", data_size);
+        TRACE_CONTEXT_ARG("data_size", data_size);
     }
     LOG("run_side_thread... {}\n", "DONE");
 }
@@ -156,13 +176,38 @@ void run_another_side_thread() {
     while (g_running) {
         TRACE_CONTEXT("work", "perf");
         size_t data_size = do_work(data);
-        TRACE_CONTEXT_ARGS("\"data_size\":{}", data_size);
+        TRACE_CONTEXT_ARG("data_size", data_size);
     }
     LOG("run_another_side_thread... {}\n", "DONE");
 }
 
 int32_t main(int32_t argc, char** argv) {
+#ifdef USE_TEF
+    bool use_harvester = false;
+    for (int32_t i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--flight-recorder") {
+            g_flight_recorder = true;
+        } else if (arg == "--harvester") {
+            use_harvester = true;
+        }
+    }
+    if (g_flight_recorder) {
+        // 64 chunks per thread is a few MB in total
+        tef::Tracer::instance().enable_flight_recorder(64);
+        fmt::print("flight recorder ON: press 'CTRL-C' to save a snapshot\n");
+    } else {
+        fmt::print("press 'CTRL-C' to toggle tracing ON\n");
+    }
+    if (use_harvester) {
+        // harvest on a Tracer thread rather than in our mainloop
+        // (TRACE_MAINLOOP below then only checks for a complete consumer)
+        constexpr uint64_t HARVEST_INTERVAL = 50;
+        TRACE_HARVESTER(HARVEST_INTERVAL);
+    }
+#else
     fmt::print("press 'CTRL-C' to toggle tracing ON\n");
+#endif // USE_TEF
     // name the process
     TRACE_PROCESS("example");
 
@@ -201,7 +246,7 @@ int32_t main(int32_t argc, char** argv) {
             // main loop also does work
             TRACE_CONTEXT("work", "perf");
             size_t data_size = do_work(data);
-            TRACE_CONTEXT_ARGS("\"data_size\":{}", data_size);
+            TRACE_CONTEXT_ARG("data_size", data_size);
         }
 
         {
@@ -210,7 +255,7 @@ int32_t main(int32_t argc, char** argv) {
 
             // for fun we add an 'arg' to this event:
             // num_events will be visible in chrome://tracing browser
-            TRACE_CONTEXT_ARGS("\"num_events\":{}", tef::Tracer::instance().get_num_events());
+            TRACE_CONTEXT_ARG("num_events", tef::Tracer::instance().get_num_events());
 
             // do TRACE harvest/maintenance
             TRACE_MAINLOOP
@@ -25,6 +25,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <vector>
 #include <queue>
 #include <memory>
@@ -34,11 +35,20 @@
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <string>
 
+#include "trace.h"
+
+// When compiled with USE_TEF the pool traces itself in category "thread_pool":
+//   - workers are named "<name>_<index>"
+//   - each task draws a flow arrow from its "enqueue" scope to its "run"
+//     scope, and an async "queue_wait" slice for its time in the queue
+//   - workers record "idle" scopes while waiting for tasks
+//   - queue depth is reported as counter "queue_depth"
 
 class Thread_pool {
 public:
-    Thread_pool(size_t);
+    Thread_pool(size_t, const std::string& name = "pool_worker");
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
@@ -54,26 +64,48 @@ private:
     std::mutex _queue_mutex;
     std::condition_variable _condition;
     bool _stop;
+
+#ifdef USE_TEF
+    // ids tie together the trace events of one task (across all pools)
+    static uint64_t next_trace_id() {
+        static std::atomic<uint64_t> id { 0 };
+        return ++id;
+    }
+#endif // USE_TEF
 };
 
 // the constructor just launches some amount of workers
-inline Thread_pool::Thread_pool(size_t threads)
+inline Thread_pool::Thread_pool(size_t threads, const std::string& name)
     :   _stop(false)
 {
     for (size_t i = 0;i<threads;++i) {
+        std::string worker_name = name + "_" + std::to_string(i);
         workers.emplace_back(
-            [this] {
+            [this, worker_name] {
+                TRACE_THREAD(worker_name);
                 for (;;) {
                     std::function<void()> task;
                     {
                         std::unique_lock<std::mutex> lock(this->_queue_mutex);
+#ifdef USE_TEF
+                        bool idle = this->tasks.empty();
+                        uint64_t idle_start = idle ? ::tef::Tracer::instance().now() : 0;
+#endif // USE_TEF
                         this->_condition.wait(lock,
                             [this]{ return this->_stop || !this->tasks.empty(); });
+#ifdef USE_TEF
+                        if (idle) {
+                            ::tef::Tracer& tracer = ::tef::Tracer::instance();
+                            tracer.add_event("idle", "thread_pool", ::tef::Phase::Complete,
+                                    idle_start, tracer.now() - idle_start);
+                        }
+#endif // USE_TEF
                         if (this->_stop && this->tasks.empty()) {
                             return;
                         }
                         task = std::move(this->tasks.front());
                         this->tasks.pop();
+                        TRACE_COUNTER("queue_depth", "thread_pool", this->tasks.size());
                     }
                     task();
                 }
@@ -88,6 +120,7 @@ auto Thread_pool::enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>
 {
     using return_type = typename std::result_of<F(Args...)>::type;
+    TRACE_CONTEXT("enqueue", "thread_pool");
 
     auto task = std::make_shared< std::packaged_task<return_type()> >(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...)
@@ -100,7 +133,20 @@ auto Thread_pool::enqueue(F&& f, Args&&... args)
         if (_stop) {
             throw std::runtime_error("enqueue on stopped Thread_pool");
         }
+#ifdef USE_TEF
+        uint64_t id = next_trace_id();
+        TRACE_FLOW_BEGIN("task", "thread_pool", id);
+        TRACE_ASYNC_BEGIN("queue_wait", "thread_pool", id);
+        tasks.emplace([task, id](){
+            TRACE_ASYNC_END("queue_wait", "thread_pool", id);
+            TRACE_CONTEXT("run", "thread_pool");
+            TRACE_FLOW_END("task", "thread_pool", id);
+            (*task)();
+        });
+#else
         tasks.emplace([task](){ (*task)(); });
+#endif // USE_TEF
+        TRACE_COUNTER("queue_depth", "thread_pool", tasks.size());
     }
     _condition.notify_one();
     return res;
@@ -0,0 +1,548 @@
+// teflib/example/util/work_stealing_pool.h
+//
+// Work_stealing_pool is an alternative to Thread_pool for many short tasks,
+// where one shared mutex and queue would cost more than the tasks:
+//
+//   - each worker has a fixed-size lock-free (Chase-Lev) deque: it pushes
+//     and pops its own tasks at the bottom while idle workers steal from
+//     the top
+//   - tasks submitted by other threads go to a lock-free inbox on one of the
+//     workers (round robin) which any idle worker may take
+//   - submit() is fire-and-forget and does not allocate: tasks live in
+//     preallocated slots with inline storage for the callable
+//   - idle workers spin, then yield, then park on their own condition
+//     variable, and submit() only wakes a worker when one is parked
+//
+// enqueue() returns a std::future like Thread_pool::enqueue() (and so
+// allocates like it).
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "trace.h"
+
+class Work_stealing_pool {
+public:
+    // max_tasks task slots are preallocated: beyond that submit() allocates
+    explicit Work_stealing_pool(size_t num_workers, size_t max_tasks = 4096,
+            const std::string& name = "steal_worker");
+    ~Work_stealing_pool();
+
+    Work_stealing_pool(const Work_stealing_pool&) = delete;
+    Work_stealing_pool& operator=(const Work_stealing_pool&) = delete;
+
+    // submit() runs f() on some worker.  It does not allocate when f is no
+    // larger than Task::STORAGE_SIZE and a task slot is free.
+    // Note: f must not throw
+    template <class F>
+    void submit(F&& f);
+
+    template<class F, class... Args>
+    auto enqueue(F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type>;
+
+    // stop accepting tasks: workers exit once all queued tasks are done
+    // Note: a submit() racing this may still queue a task after the workers
+    // exit: the destructor runs those (so enqueue()'s futures get ready)
+    void stop_everything();
+
+private:
+    struct Task {
+        static constexpr size_t STORAGE_SIZE = 32;
+
+        void (*run)(Task*) { nullptr }; // invokes then destroys the callable
+        Task* next_inbox { nullptr };
+        std::atomic<uint32_t> next_free { 0 }; // slot index + 1
+        bool on_heap { false };
+        typename std::aligned_storage<STORAGE_SIZE, alignof(std::max_align_t)>::type storage;
+    };
+
+    // Deque is Chase-Lev's work-stealing deque with a fixed capacity,
+    // after "Correct and Efficient Work-Stealing for Weak Memory Models"
+    // (Le, Pop, Cohen, Zappa Nardelli 2013)
+    class Deque {
+    public:
+        static constexpr int64_t CAPACITY = 1024; // power of 2
+
+        Deque() {
+            for (auto& task : _tasks) {
+                task.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        // owner only: returns false when full
+        bool push(Task* task) {
+            int64_t bottom = _bottom.load(std::memory_order_relaxed);
+            int64_t top = _top.load(std::memory_order_acquire);
+            if (bottom - top >= CAPACITY) {
+                return false;
+            }
+            _tasks[bottom & (CAPACITY - 1)].store(task, std::memory_order_relaxed);
+            // a release store rather than the paper's fence: the same on
+            // x86 and visible to ThreadSanitizer
+            _bottom.store(bottom + 1, std::memory_order_release);
+            return true;
+        }
+
+        // owner only
+        Task* pop() {
+            int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+            _bottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t top = _top.load(std::memory_order_relaxed);
+            if (top > bottom) {
+                // empty
+                _bottom.store(bottom + 1, std::memory_order_release);
+                return nullptr;
+            }
+            Task* task = _tasks[bottom & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if (top == bottom) {
+                // last one: race the thieves for it
+                if (!_top.compare_exchange_strong(top, top + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    task = nullptr;
+                }
+                _bottom.store(bottom + 1, std::memory_order_release);
+            }
+            return task;
+        }
+
+        // any thread: returns nullptr when empty or on losing a race
+        Task* steal() {
+            int64_t top = _top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t bottom = _bottom.load(std::memory_order_acquire);
+            if (top >= bottom) {
+                return nullptr;
+            }
+            Task* task = _tasks[top & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if (!_top.compare_exchange_strong(top, top + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return task;
+        }
+
+    private:
+        std::atomic<int64_t> _top { 0 };
+        char _pad[64]; // keep thieves and owner off each other's cache line
+        std::atomic<int64_t> _bottom { 0 };
+        std::atomic<Task*> _tasks[CAPACITY];
+    };
+
+    struct Worker {
+        size_t index { 0 };
+        Deque deque;
+        std::atomic<Task*> inbox { nullptr }; // LIFO list, taken whole
+        uint32_t local_free { 0 }; // owner only: free slots list
+        uint32_t num_local_free { 0 };
+        std::atomic<bool> parked { false };
+        std::mutex park_mutex;
+        std::condition_variable park_condition;
+        bool wake { false }; // under park_mutex
+        std::thread thread;
+    };
+
+    // which pool and Worker (if any) the current thread works for
+    struct Current_worker {
+        const Work_stealing_pool* pool;
+        Worker* worker;
+    };
+    static Current_worker& current() {
+        static thread_local Current_worker current = { nullptr, nullptr };
+        return current;
+    }
+    Worker* current_worker() const {
+        Current_worker& id = current();
+        return id.pool == this ? id.worker : nullptr;
+    }
+
+    template <class F>
+    static void store_callable(Task* task, F&& f, std::true_type);
+    template <class F>
+    static void store_callable(Task* task, F&& f, std::false_type);
+    Task* allocate_task();
+    void free_task(Task* task);
+    void push_free(uint32_t first, uint32_t last);
+    uint32_t pop_free();
+
+    void push_task(Task* task);
+    void push_inbox(Worker& worker, Task* task);
+    Task* take_inbox(Worker& self, Worker& from);
+    Task* find_task(Worker& self);
+    void run_task(Task* task);
+    void wake_one(size_t preferred);
+    void park(Worker& self);
+    void run_worker(Worker& self, const std::string& name);
+
+    std::unique_ptr<Task[]> _slots;
+    size_t _num_slots { 0 };
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::atomic<uint64_t> _free_head { 0 }; // ABA tag << 32 | slot index + 1
+    std::atomic<size_t> _next_inbox { 0 };
+    std::atomic<int32_t> _num_parked { 0 };
+    std::atomic<bool> _stop { false };
+};
+
+inline Work_stealing_pool::Work_stealing_pool(size_t num_workers, size_t max_tasks, const std::string& name) {
+    if (num_workers == 0) {
+        num_workers = 1;
+    }
+    max_tasks = std::min(max_tasks, (size_t)(UINT32_MAX - 1));
+    _num_slots = max_tasks;
+    _slots.reset(new Task[_num_slots]);
+    if (_num_slots > 0) {
+        for (uint32_t i = 0; i + 1 < _num_slots; ++i) {
+            _slots[i].next_free.store(i + 2, std::memory_order_relaxed);
+        }
+        _free_head.store(1, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < num_workers; ++i) {
+        _workers.emplace_back(new Worker());
+        _workers.back()->index = i;
+    }
+    // start threads only once all workers exist since they steal from each other
+    for (size_t i = 0; i < num_workers; ++i) {
+        Worker* worker = _workers[i].get();
+        std::string worker_name = name + "_" + std::to_string(i);
+        worker->thread = std::thread([this, worker, worker_name] { run_worker(*worker, worker_name); });
+    }
+}
+
+inline Work_stealing_pool::~Work_stealing_pool() {
+    stop_everything();
+    for (auto& worker : _workers) {
+        worker->thread.join();
+    }
+    // run what submits racing stop_everything() queued after the workers left
+    for (auto& worker : _workers) {
+        Task* task;
+        while ((task = worker->deque.pop()) || (task = take_inbox(*worker, *worker))) {
+            run_task(task);
+        }
+    }
+}
+
+inline void Work_stealing_pool::stop_everything() {
+    _stop.store(true);
+    for (auto& worker : _workers) {
+        {
+            std::lock_guard<std::mutex> lock(worker->park_mutex);
+            worker->wake = true;
+        }
+        worker->park_condition.notify_one();
+    }
+}
+
+template <class F>
+void Work_stealing_pool::store_callable(Task* task, F&& f, std::true_type) {
+    using Callable = typename std::decay<F>::type;
+    new (&task->storage) Callable(std::forward<F>(f));
+    task->run = [](Task* t) {
+        Callable* callable = static_cast<Callable*>(static_cast<void*>(&t->storage));
+        (*callable)();
+        callable->~Callable();
+    };
+}
+
+template <class F>
+void Work_stealing_pool::store_callable(Task* task, F&& f, std::false_type) {
+    // too big to store inline
+    using Callable = typename std::decay<F>::type;
+    Callable* callable = new Callable(std::forward<F>(f));
+    new (&task->storage) Callable*(callable);
+    task->run = [](Task* t) {
+        Callable* callable = *static_cast<Callable**>(static_cast<void*>(&t->storage));
+        (*callable)();
+        delete callable;
+    };
+}
+
+template <class F>
+void Work_stealing_pool::submit(F&& f) {
+    using Callable = typename std::decay<F>::type;
+    if (_stop.load(std::memory_order_relaxed)) {
+        throw std::runtime_error("submit on stopped Work_stealing_pool");
+    }
+    Task* task = allocate_task();
+    store_callable(task, std::forward<F>(f), std::integral_constant<bool,
+        sizeof(Callable) <= Task::STORAGE_SIZE && alignof(Callable) <= alignof(std::max_align_t)>());
+    push_task(task);
+}
+
+template<class F, class... Args>
+auto Work_stealing_pool::enqueue(F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    using return_type = typename std::result_of<F(Args...)>::type;
+    auto task = std::make_shared< std::packaged_task<return_type()> >(
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+        );
+    std::future<return_type> res = task->get_future();
+    submit([task](){ (*task)(); });
+    return res;
+}
+
+inline Work_stealing_pool::Task* Work_stealing_pool::allocate_task() {
+    uint32_t index = 0;
+    Worker* worker = current_worker();
+    if (worker && worker->local_free != 0) {
+        index = worker->local_free;
+        worker->local_free = _slots[index - 1].next_free.load(std::memory_order_relaxed);
+        --worker->num_local_free;
+    } else {
+        index = pop_free();
+    }
+    if (index == 0) {
+        // out of slots
+        Task* task = new Task();
+        task->on_heap = true;
+        return task;
+    }
+    return &_slots[index - 1];
+}
+
+inline void Work_stealing_pool::free_task(Task* task) {
+    if (task->on_heap) {
+        delete task;
+        return;
+    }
+    uint32_t index = (uint32_t)(task - _slots.get()) + 1;
+    Worker* worker = current_worker();
+    if (!worker) {
+        push_free(index, index);
+        return;
+    }
+    // keep a few slots on hand and return the rest to the shared list in
+    // batches, since workers free the slots that submitters allocate
+    constexpr uint32_t BATCH = 32;
+    task->next_free.store(worker->local_free, std::memory_order_relaxed);
+    worker->local_free = index;
+    if (++worker->num_local_free > 2 * BATCH) {
+        uint32_t first = worker->local_free;
+        uint32_t last = first;
+        for (uint32_t i = 1; i < BATCH; ++i) {
+            last = _slots[last - 1].next_free.load(std::memory_order_relaxed);
+        }
+        worker->local_free = _slots[last - 1].next_free.load(std::memory_order_relaxed);
+        worker->num_local_free -= BATCH;
+        push_free(first, last);
+    }
+}
+
+inline void Work_stealing_pool::push_free(uint32_t first, uint32_t last) {
+    // first..last are already linked through next_free
+    uint64_t head = _free_head.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        _slots[last - 1].next_free.store((uint32_t)(head), std::memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | first;
+    } while (!_free_head.compare_exchange_weak(head, new_head,
+                std::memory_order_release, std::memory_order_relaxed));
+}
+
+inline uint32_t Work_stealing_pool::pop_free() {
+    // the tag in the high bits changes on every update, which makes the
+    // compare_exchange fail if the head was popped and pushed back (ABA)
+    uint64_t head = _free_head.load(std::memory_order_acquire);
+    for (;;) {
+        uint32_t index = (uint32_t)(head);
+        if (index == 0) {
+            return 0;
+        }
+        uint32_t next = _slots[index - 1].next_free.load(std::memory_order_relaxed);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (_free_head.compare_exchange_weak(head, new_head,
+                    std::memory_order_acquire, std::memory_order_acquire)) {
+            return index;
+        }
+    }
+}
+
+inline void Work_stealing_pool::push_task(Task* task) {
+    Worker* worker = current_worker();
+    size_t target;
+    if (worker) {
+        // tasks submitted by tasks stay local unless stolen
+        if (!worker->deque.push(task)) {
+            push_inbox(*worker, task);
+        }
+        target = worker->index + 1;
+    } else {
+        target = _next_inbox.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+        push_inbox(*_workers[target], task);
+    }
+    // Note: this fence pairs with the one in park(): either the parking
+    // worker sees our task or we see it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_num_parked.load(std::memory_order_relaxed) > 0) {
+        wake_one(target);
+    }
+}
+
+inline void Work_stealing_pool::push_inbox(Worker& worker, Task* task) {
+    Task* head = worker.inbox.load(std::memory_order_relaxed);
+    do {
+        task->next_inbox = head;
+    } while (!worker.inbox.compare_exchange_weak(head, task,
+                std::memory_order_release, std::memory_order_relaxed));
+}
+
+inline Work_stealing_pool::Task* Work_stealing_pool::take_inbox(Worker& self, Worker& from) {
+    // take the whole list (so there is no ABA) and put it in submit order
+    Task* list = from.inbox.exchange(nullptr, std::memory_order_acquire);
+    Task* reversed = nullptr;
+    while (list) {
+        Task* next = list->next_inbox;
+        list->next_inbox = reversed;
+        reversed = list;
+        list = next;
+    }
+    if (!reversed) {
+        return nullptr;
+    }
+    // run the first and queue the rest where they can be stolen
+    Task* task = reversed;
+    Task* rest = reversed->next_inbox;
+    while (rest) {
+        Task* next = rest->next_inbox;
+        if (!self.deque.push(rest)) {
+            push_inbox(self, rest);
+        }
+        rest = next;
+    }
+    return task;
+}
+
+inline Work_stealing_pool::Task* Work_stealing_pool::find_task(Worker& self) {
+    Task* task = self.deque.pop();
+    if (task) {
+        return task;
+    }
+    task = take_inbox(self, self);
+    if (task) {
+        return task;
+    }
+    size_t num_workers = _workers.size();
+    for (size_t i = 1; i < num_workers; ++i) {
+        Worker& victim = *_workers[(self.index + i) % num_workers];
+        task = victim.deque.steal();
+        if (!task) {
+            task = take_inbox(self, victim);
+        }
+        if (task) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+inline void Work_stealing_pool::run_task(Task* task) {
+    task->run(task);
+    free_task(task);
+}
+
+inline void Work_stealing_pool::wake_one(size_t preferred) {
+    size_t num_workers = _workers.size();
+    for (size_t i = 0; i < num_workers; ++i) {
+        Worker& worker = *_workers[(preferred + i) % num_workers];
+        if (worker.parked.load(std::memory_order_relaxed) && worker.parked.exchange(false)) {
+            _num_parked.fetch_sub(1);
+            {
+                std::lock_guard<std::mutex> lock(worker.park_mutex);
+                worker.wake = true;
+            }
+            worker.park_condition.notify_one();
+            return;
+        }
+    }
+}
+
+inline void Work_stealing_pool::park(Worker& self) {
+#ifdef USE_TEF
+    uint64_t park_start = ::tef::Tracer::instance().now();
+#endif // USE_TEF
+    self.parked.store(true);
+    _num_parked.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // check once more now that submitters can see we are parked
+    Task* task = find_task(self);
+    if (task || _stop.load()) {
+        if (self.parked.exchange(false)) {
+            _num_parked.fetch_sub(1);
+        }
+        if (task) {
+            run_task(task);
+        }
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(self.park_mutex);
+        self.park_condition.wait(lock, [&self] { return self.wake; });
+        self.wake = false;
+    }
+    if (self.parked.exchange(false)) {
+        _num_parked.fetch_sub(1);
+    }
+#ifdef USE_TEF
+    ::tef::Tracer& tracer = ::tef::Tracer::instance();
+    tracer.add_event("park", "thread_pool", ::tef::Phase::Complete, park_start, tracer.now() - park_start);
+#endif // USE_TEF
+}
+
+inline void Work_stealing_pool::run_worker(Worker& self, const std::string& name) {
+    TRACE_THREAD(name);
+    (void)name;
+    current() = { this, &self };
+    // backoff: spin, then yield, then park
+    constexpr uint32_t SPIN_ROUNDS = 64;
+    constexpr uint32_t YIELD_ROUNDS = 16;
+    uint32_t idle_rounds = 0;
+    for (;;) {
+        Task* task = find_task(self);
+        if (task) {
+            run_task(task);
+            idle_rounds = 0;
+            continue;
+        }
+        if (_stop.load(std::memory_order_acquire)) {
+            break;
+        }
+        ++idle_rounds;
+        if (idle_rounds < SPIN_ROUNDS) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        } else if (idle_rounds < SPIN_ROUNDS + YIELD_ROUNDS) {
+            std::this_thread::yield();
+        } else {
+            park(self);
+            idle_rounds = 0;
+        }
+    }
+    // return our cached slots
+    while (self.local_free != 0) {
+        uint32_t index = self.local_free;
+        self.local_free = _slots[index - 1].next_free.load(std::memory_order_relaxed);
+        push_free(index, index);
+    }
+    self.num_local_free = 0;
+    current() = { nullptr, nullptr };
+}
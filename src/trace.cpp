@@ -6,7 +6,30 @@
 
 #include "trace.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <new>
 #include <sstream>
+#if defined(__x86_64__) && !defined(TEF_USE_STEADY_CLOCK)
+#include <cpuid.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#else
+#include <process.h>
+#endif // _WIN32
 
 // Note: TEFLIB_TRACE_LOG is a hook for printing trace state transitions to stdout.
 // To use it, supply your own variable argument macro implementation.  For example:
@@ -20,6 +43,216 @@
 
 using namespace tef;
 
+namespace {
+    // every JSON trace starts with this (and ends with "\n]\n}")
+    const char JSON_TRACE_HEADER[] = "{\"traceEvents\":[\n";
+
+    // fast integer to ascii: two digits at a time from a lookup table
+    const char DIGIT_PAIRS[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    void append_uint(std::string& out, uint64_t value) {
+        char buffer[20];
+        char* end = buffer + sizeof(buffer);
+        char* p = end;
+        while (value >= 100) {
+            uint32_t pair = (uint32_t)(value % 100) * 2;
+            value /= 100;
+            *--p = DIGIT_PAIRS[pair + 1];
+            *--p = DIGIT_PAIRS[pair];
+        }
+        if (value >= 10) {
+            uint32_t pair = (uint32_t)(value) * 2;
+            *--p = DIGIT_PAIRS[pair + 1];
+            *--p = DIGIT_PAIRS[pair];
+        } else {
+            *--p = (char)('0' + value);
+        }
+        out.append(p, end - p);
+    }
+
+    void append_int(std::string& out, int64_t value) {
+        if (value < 0) {
+            out.push_back('-');
+            // Note: negate as unsigned so INT64_MIN works
+            append_uint(out, ~(uint64_t)(value) + 1);
+        } else {
+            append_uint(out, (uint64_t)(value));
+        }
+    }
+
+    // appends str with JSON string escapes (without enclosing quotes)
+    void append_escaped(std::string& out, const std::string& str) {
+        const char* HEX = "0123456789abcdef";
+        for (size_t i = 0; i < str.size(); ++i) {
+            unsigned char c = (unsigned char)(str[i]);
+            if (c == '"' || c == '\\') {
+                out.push_back('\\');
+                out.push_back((char)c);
+            } else if (c < 0x20) {
+                out.append("\\u00");
+                out.push_back(HEX[c >> 4]);
+                out.push_back(HEX[c & 0xf]);
+            } else {
+                out.push_back((char)c);
+            }
+        }
+    }
+
+    // out += {"key":value,...}
+    // where strings are interned and already JSON-escaped
+    void append_args_json(
+            std::string& out,
+            const Tracer::Event& event,
+            const Arg* args,
+            const char* text,
+            const std::string* strings)
+    {
+        out.push_back('{');
+        char buffer[32];
+        for (uint32_t i = 0; i < event.num_args; ++i) {
+            const Arg& arg = args[event.args_begin + i];
+            if (i > 0) {
+                out.push_back(',');
+            }
+            if (arg.type == Arg::JSON) {
+                out.append(text + arg.value.text.offset, arg.value.text.size);
+                continue;
+            }
+            out.push_back('"');
+            out.append(strings[arg.key]);
+            out.append("\":");
+            switch (arg.type) {
+                case Arg::INT:
+                    append_int(out, arg.value.i);
+                    break;
+                case Arg::UINT:
+                    append_uint(out, arg.value.u);
+                    break;
+                case Arg::DOUBLE:
+                    // JSON has no representation for nan or inf
+                    if (std::isfinite(arg.value.d)) {
+                        int size = snprintf(buffer, sizeof(buffer), "%.15g", arg.value.d);
+                        out.append(buffer, size);
+                    } else {
+                        out.append("null");
+                    }
+                    break;
+                case Arg::BOOL:
+                    out.append(arg.value.b ? "true" : "false");
+                    break;
+                case Arg::STRING:
+                    out.push_back('"');
+                    out.append(strings[arg.value.str]);
+                    out.push_back('"');
+                    break;
+                default:
+                    out.append("null");
+                    break;
+            }
+        }
+        out.push_back('}');
+    }
+
+    // out += value as lower case hex without leading zeros
+    void append_hex(std::string& out, uint64_t value) {
+        char buffer[16];
+        size_t size = 0;
+        do {
+            buffer[size++] = "0123456789abcdef"[value & 0xf];
+            value >>= 4;
+        } while (value != 0);
+        while (size > 0) {
+            out.push_back(buffer[--size]);
+        }
+    }
+
+    // out += time in usec, where value is in usec or in nsec (as fractional usec)
+    void append_time(std::string& out, uint64_t value, uint64_t units_per_second) {
+        if (units_per_second != NSEC_PER_SECOND) {
+            append_uint(out, value);
+            return;
+        }
+        append_uint(out, value / 1000);
+        uint32_t nsec = (uint32_t)(value % 1000);
+        if (nsec != 0) {
+            char digits[4] = { '.', (char)('0' + nsec / 100), (char)('0' + (nsec / 10) % 10), (char)('0' + nsec % 10) };
+            size_t size = 4;
+            while (digits[size - 1] == '0') {
+                --size;
+            }
+            out.append(digits, size);
+        }
+    }
+
+    // out += one event as TEF JSON
+    // where strings are interned and already JSON-escaped
+    void append_event_json(
+            std::string& out,
+            const Tracer::Event& event,
+            const std::string& pid,
+            const std::string& tid,
+            const Arg* args,
+            const char* text,
+            const std::string* strings,
+            uint64_t ts_units_per_second)
+    {
+        out.append("{\"name\":\"");
+        out.append(strings[event.name]);
+        out.append("\",\"cat\":\"");
+        out.append(strings[event.cat]);
+        out.append("\",\"ph\":\"");
+        out.push_back(event.ph);
+        out.append("\",\"ts\":");
+        append_time(out, event.ts, ts_units_per_second);
+        if (event.ph == Phase::Complete) {
+            out.append(",\"dur\":");
+            append_time(out, event.dur, ts_units_per_second);
+        } else if (has_id(event.ph)) {
+            out.append(",\"id\":\"0x");
+            append_hex(out, event.id);
+            out.push_back('"');
+            if (event.ph == Phase::FlowEnd) {
+                // bind to the enclosing slice rather than the next one
+                out.append(",\"bp\":\"e\"");
+            }
+        }
+        out.append(",\"pid\":");
+        out.append(pid);
+        out.append(",\"tid\":");
+        out.append(tid);
+        if (event.num_args > 0) {
+            out.append(",\"args\":");
+            append_args_json(out, event, args, text, strings);
+        }
+        out.push_back('}');
+    }
+
+    // out += clock_sync event saying steady_clock read nsec at ts
+    void append_clock_sync_json(std::string& out, const std::string& pid, uint64_t ts,
+            uint64_t ts_units_per_second, uint64_t nsec)
+    {
+        out.append("{\"name\":\"clock_sync\",\"ph\":\"c\",\"pid\":");
+        out.append(pid);
+        out.append(",\"tid\":0,\"ts\":");
+        append_time(out, ts, ts_units_per_second);
+        out.append(",\"args\":{\"sync_id\":\"steady_clock:");
+        append_uint(out, nsec);
+        out.append("\",\"steady_clock_nsec\":");
+        append_uint(out, nsec);
+        out.append("}}");
+    }
+}
+
 uint64_t tef::get_now_msec() {
     using namespace std::chrono;
     static uint64_t msec_offset = 0;
@@ -30,348 +263,3327 @@ uint64_t tef::get_now_msec() {
     return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count() + msec_offset;
 }
 
+uint32_t tef::get_process_id() {
+#ifdef _WIN32
+    return (uint32_t)(_getpid());
+#else
+    return (uint32_t)(getpid());
+#endif // _WIN32
+}
+
 std::unique_ptr<Tracer> Tracer::_instance;
+std::atomic<Category_mask> Tracer::_enabled_categories { 0 };
+
+void Tracer::Consumer::consume_batch(const Batch& batch) {
+    // compatibility adapter: split batch into one string per event
+    // Note: assign() reuses the capacity of strings left from last time
+    _event_strings.resize(batch.num_events);
+    size_t begin = 0;
+    for (size_t i = 0; i < batch.num_events; ++i) {
+        _event_strings[i].assign(batch.data + begin, batch.ends[i] - begin);
+        begin = batch.ends[i] + 2; // skip ",\n"
+    }
+    consume_events(_event_strings);
+}
+
+// static
+bool Clock::has_invariant_counter() {
+#if defined(TEF_USE_STEADY_CLOCK) || !(defined(__x86_64__) || defined(__aarch64__))
+    return false;
+#elif defined(__x86_64__)
+    // CPUID 0x80000007 EDX bit 8: invariant TSC
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1u << 8)) != 0;
+#else
+    return true;
+#endif
+}
+
+Clock::Clock(bool use_counter) :
+    _use_counter(!IS_STEADY_CLOCK && use_counter && has_invariant_counter()),
+    _origin_time(std::chrono::steady_clock::now()), _origin(ticks()) {
+    if (!IS_STEADY_CLOCK && use_counter && !_use_counter) {
+        TEFLIB_TRACE_LOG("clock: the TSC isn't invariant, using steady_clock\n");
+    }
+}
+
+void Clock::measure_rate() const {
+    // measure the tick rate over at least CALIBRATION_USEC since _origin:
+    // normally that much has passed by the first harvest so we don't wait
+    using namespace std::chrono;
+    constexpr int64_t CALIBRATION_USEC = 20000;
+    steady_clock::time_point t = steady_clock::now();
+    int64_t elapsed = duration_cast<nanoseconds>(t - _origin_time).count();
+    if (elapsed < CALIBRATION_USEC * 1000) {
+        std::this_thread::sleep_for(nanoseconds(CALIBRATION_USEC * 1000 - elapsed));
+    }
+    // read ticks between two steady_clock reads and use their midpoint
+    steady_clock::time_point t0 = steady_clock::now();
+    uint64_t ticks_now = ticks();
+    steady_clock::time_point t1 = steady_clock::now();
+    double usec = (double)(duration_cast<nanoseconds>(t0 - _origin_time).count()
+            + duration_cast<nanoseconds>(t1 - _origin_time).count()) * 0.5e-3;
+    if (ticks_now > _origin && usec > 0.0) {
+        _usec_per_tick = usec / (double)(ticks_now - _origin);
+    }
+    TEFLIB_TRACE_LOG("clock calibrated usec_per_tick={}\n", _usec_per_tick);
+}
 
 // static
 std::string Tracer::thread_id_as_string() {
-    // unfortunately, fmt doesn't know how to handle std::thread::id
-    // hence this static helper method
-    std::ostringstream tid_str;
-    tid_str << std::this_thread::get_id();
-    return tid_str.str();
+    return std::to_string(instance().get_thread_record().tid);
 }
 
-void Tracer::add_event(const std::string& name, const std::string& cat, Phase ph, uint64_t ts, uint64_t dur) {
-    if (_enabled) {
-        if (ts == 0)
-        {
-            ts = Tracer::instance().now();
+Tracer::Thread_buffer::Thread_buffer(uint32_t ring_size, String_id tid_str) : tid(tid_str) {
+    if (ring_size > 0) {
+        // all memory is allocated up front
+        ring.resize(ring_size);
+        for (uint32_t i = 0; i < ring_size; ++i) {
+            ring[i] = new Event_chunk;
         }
-        std::lock_guard<std::mutex> lock(_event_mutex);
-        _events.push_back({name, cat, ts, dur, std::this_thread::get_id(), -1, ph});
+        ring[0]->generation.store(generation, std::memory_order_release);
+        head = nullptr;
+        tail = ring[0];
+    } else {
+        head = new Event_chunk;
+        tail = head;
     }
 }
 
-void Tracer::add_event_with_args(
-        const std::string& name,
-        const std::string& cat,
-        Phase ph,
-        const std::string& args,
-        uint64_t ts,
-        uint64_t dur)
-{
-    if (_enabled) {
-        if (ts == 0)
-        {
-            ts = Tracer::instance().now();
+Tracer::Thread_buffer::~Thread_buffer() {
+    for (size_t i = 0; i < ring.size(); ++i) {
+        delete ring[i];
+    }
+    Event_chunk* lists[] = { head, free_chunks.load(std::memory_order_acquire), spare_chunks };
+    for (Event_chunk* chunk : lists) {
+        while (chunk) {
+            Event_chunk* next = chunk->next.load(std::memory_order_relaxed);
+            delete chunk;
+            chunk = next;
         }
-        std::lock_guard<std::mutex> lock(_event_mutex);
-        int32_t args_index = (int32_t)(_args.size());
-        _args.push_back(args);
-        _events.push_back({name, cat, ts, dur, std::this_thread::get_id(), args_index, ph});
     }
 }
 
-void Tracer::set_counter(
-        const std::string& name,
-        const std::string& cat,
-        int64_t count)
-{
-    if (_enabled) {
-#ifdef NO_FMT
-        std::string args = "\"";
-        args.append(name);
-        args.append("\":");
-        std::ostringstream ss;
-        ss << count;
-        args.append(ss.str());
-#else
-        std::string args = fmt::format("\"{}\":{}", name, count);
-#endif // NO_FMT
-        std::lock_guard<std::mutex> lock(_event_mutex);
-        int32_t args_index = (int32_t)(_args.size());
-        _args.push_back(args);
-        _events.push_back({name, cat, now(), 0, std::this_thread::get_id(), args_index, Phase::Counter});
-    }
+namespace {
+    // Thread_exit_handle marks its thread's buffer (or record) as exited
+    // when the thread ends so the harvester knows it can free it once
+    // drained.
+    struct Thread_exit_handle {
+        ~Thread_exit_handle() {
+            if (exited) {
+                exited->store(true, std::memory_order_release);
+            }
+        }
+        std::atomic<bool>* exited { nullptr };
+    };
 }
 
-void Tracer::add_meta_event(const std::string& type, const std::string& arg) {
-    // Note: 'type' has a finite set of acceptable values
-    //   process_name
-    //   process_labels
-    //   thread_name
-    std::string arg_name;
-    if (type == "process_name") {
-        arg_name = "name";
-    } else if (type == "process_labels") {
-        arg_name = "labels";
-    } else if (type == "thread_name") {
-        arg_name = "name";
+Tracer::~Tracer() {
+    // trace macros run after this (e.g. in static destructors) must not find us
+    _enabled_categories.store(0);
+    stop_harvester();
+    stop_serializer_threads();
+    {
+        std::lock_guard<std::mutex> lock(_buffers_mutex);
+        for (size_t i = 0; i < _buffers.size(); ++i) {
+            // Note: buffers of threads that are still running are leaked
+            // rather than pulled out from under them.
+            if (_buffers[i]->exited.load(std::memory_order_acquire)) {
+                delete _buffers[i];
+            }
+        }
     }
-    if (!arg_name.empty()) {
-        // unfortunately, fmt doesn't know how to handle std::thread::id
-        // so we format into string
-        std::string tid_str = thread_id_as_string();
-
-        // meta_events get formatted to strings immediately
-        std::lock_guard<std::mutex> lock(_event_mutex);
-#ifdef NO_FMT
-        std::string s = "{\"name\":\"";
-        s.append(type);
-        s.append("\",\"ph\":\"M\",\"pid\":1,\"tid\":");
-        s.append(tid_str);
-        s.append(",\"args\":{\"");
-        s.append(arg_name);
-        s.append("\":\"");
-        s.append(arg);
-        s.append("\"}}");
-        _meta_events.push_back(s);
-#else
-        _meta_events.push_back(
-            fmt::format("{{\"name\":\"{}\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"{}\":\"{}\"}}}}",
-                type, tid_str, arg_name, arg));
-#endif // NO_FMT
+    std::lock_guard<std::mutex> lock(_meta_mutex);
+    for (size_t i = 0; i < _thread_records.size(); ++i) {
+        if (_thread_records[i]->exited.load(std::memory_order_acquire)) {
+            delete _thread_records[i];
+        }
     }
 }
 
-void Tracer::add_meta_event(const std::string& type, uint32_t arg) {
-    // Note: 'type' has a finite set of acceptable values
-    //   process_sort_index
-    //   thread_sort_index
-    std::string arg_name;
-    if (type == "process_sort_index" || type == "thread_sort_index") {
-        std::string tid_str = thread_id_as_string();
-
-        // meta_events get formatted to strings immediately
-#ifdef NO_FMT
-        std::string event = "{\"name\":\"";
-        event.append(type);
-        event.append("\",\"ph\":\"M\",\"pid\":1,\"tid\":");
-        event.append(tid_str);
-        event.append(",\"args\":{\"sort_index\":");
-        std::ostringstream ss;
-        ss << arg;
-        event.append(ss.str());
-        event.append("}}");
-#else
-        std::string event = fmt::format(
-                "{{\"name\":\"{}\",\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"sort_index\":{}}}}}",
-                type, tid_str, arg);
-#endif // NO_FMT
-        std::lock_guard<std::mutex> lock(_event_mutex);
-        _meta_events.push_back(event);
+Tracer::Thread_record& Tracer::get_thread_record() {
+    thread_local Thread_record* record = nullptr;
+    thread_local Thread_exit_handle handle;
+    if (!record) {
+        // first event or metadata on this thread: register it
+        Thread_record* new_record = new Thread_record;
+        {
+            std::lock_guard<std::mutex> lock(_meta_mutex);
+            new_record->tid = _next_tid++;
+        }
+        new_record->tid_str = intern(std::to_string(new_record->tid));
+        record = new_record;
+        handle.exited = &(record->exited);
+        std::lock_guard<std::mutex> lock(_meta_mutex);
+        _thread_records.push_back(record);
     }
+    return *record;
 }
 
-void Tracer::advance_consumers() {
-    if (_events.empty()) {
-        return;
+Tracer::Thread_buffer& Tracer::get_thread_buffer() {
+    thread_local Thread_buffer* buffer = nullptr;
+    thread_local Thread_exit_handle handle;
+    if (!buffer) {
+        // first event on this thread: register a new buffer
+        // (this is the only time a producer takes a shared lock)
+        buffer = new Thread_buffer(_ring_size, get_thread_record().tid_str);
+        _chunks_allocated.fetch_add(_ring_size > 0 ? _ring_size : 1, std::memory_order_relaxed);
+        handle.exited = &(buffer->exited);
+        std::lock_guard<std::mutex> lock(_buffers_mutex);
+        _buffers.push_back(buffer);
     }
+    return *buffer;
+}
 
-    // swap events out
-    std::vector<Event> events;
-    std::vector<std::string> args;
-    {
-        std::lock_guard<std::mutex> lock(_event_mutex);
-        events.swap(_events);
-        args.swap(_args);
+String_id Tracer::intern(const std::string& str) {
+    std::lock_guard<std::mutex> lock(_strings_mutex);
+    auto itr = _string_ids.find(str);
+    if (itr != _string_ids.end()) {
+        return itr->second;
     }
+    String_id id = (String_id)(_strings.size());
+    _strings.push_back(str);
+    _string_ids[str] = id;
+    return id;
+}
 
-    if (_consumers.empty()) {
-        return;
+String_id Tracer::intern_literal(const char* str) {
+    // cache is direct-mapped on address: a collision just means an extra
+    // (locked) intern() call
+    struct Entry {
+        const char* str;
+        String_id id;
+    };
+    constexpr size_t CACHE_SIZE = 64;
+    thread_local Entry cache[CACHE_SIZE] = {};
+    uintptr_t key = reinterpret_cast<uintptr_t>(str);
+    Entry& entry = cache[(key ^ (key >> 6)) % CACHE_SIZE];
+    if (entry.str != str) {
+        entry.id = intern(str);
+        entry.str = str;
     }
+    return entry.id;
+}
 
-    // convert events to strings
-    std::vector<std::string> event_strings;
-    std::string ph_str("a");
-    for (size_t i = 0; i < events.size(); ++i) {
-        // For reference:
-        //
-        //   name = human readable name for the event
-        //   cat = comma separated strings used for filtering
-        //   ph = phase type
-        //   ts = timestamp
-        //   dur = duration
-        //   tid = thread_id
-        //   pid = process_id
-        //   args = JSON string of special info
-
-        const auto& event = events[i];
-        // for speed we use fmt formatting where possible...
-        ph_str[0] = event.ph;
-        std::ostringstream stream;
-        if (event.ph == Phase::Complete)
-        {
-#ifdef NO_FMT
-            stream << "{\"name\":\"" << event.name << "\""
-                << ",\"cat\":\"" << event.cat << "\""
-                << ",\"ph\":\"" << ph_str << "\""
-                << ",\"ts\":" << event.ts
-                << ",\"dur\":" << event.dur
-                << ",\"pid\":1";
-#else
-            stream << fmt::format(
-                    "{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"{}\",\"ts\":{},\"dur\":{},\"pid\":1",
-                    event.name, event.cat, ph_str, event.ts, event.dur);
-#endif // NO_FMT
-        }
-        else
+Category_mask Tracer::get_category_mask(String_id cat) {
+    // cache is direct-mapped on id: a collision just means an extra lookup
+    struct Entry {
+        String_id cat;
+        Category_mask mask;
+    };
+    // (valid masks are never zero so a zero mask marks an empty entry)
+    constexpr size_t CACHE_SIZE = 64;
+    thread_local Entry cache[CACHE_SIZE] = {};
+    Entry& entry = cache[cat % CACHE_SIZE];
+    if (entry.cat != cat || entry.mask == 0) {
+        Category_mask mask = 0;
         {
-#ifdef NO_FMT
-            stream << "{\"name\":\"" << event.name << "\""
-                << ",\"cat\":\"" << event.cat << "\""
-                << ",\"ph\":\"" << ph_str << "\""
-                << ",\"ts\":" << event.ts
-                << ",\"pid\":1";
-#else
-            stream << fmt::format(
-                    "{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"{}\",\"ts\":{},\"pid\":1",
-                    event.name, event.cat, ph_str, event.ts);
-#endif // NO_FMT
+            std::lock_guard<std::mutex> lock(_strings_mutex);
+            auto itr = _category_masks.find(cat);
+            if (itr != _category_masks.end()) {
+                mask = itr->second;
+            }
         }
-        // and std::ostream formatting when necessary...
-        stream << ",\"tid\":" << event.tid;
-        if (event.args_index != -1) {
-            stream << ",\"args\":" << args[event.args_index];
+        if (mask == 0) {
+            mask = get_category_mask(get_string(cat));
+            std::lock_guard<std::mutex> lock(_strings_mutex);
+            _category_masks[cat] = mask;
         }
-        stream << "}";
-        event_strings.push_back(stream.str());
+        entry.cat = cat;
+        entry.mask = mask;
     }
+    return entry.mask;
+}
 
-    // consume event strings
-    uint64_t now = get_now_msec();
-    std::lock_guard<std::mutex> lock(_consumer_mutex);
-    std::vector<Tracer::Consumer*> expired_consumers;
-    size_t i = 0;
-    while (i < _consumers.size()) {
-        Tracer::Consumer* consumer = _consumers[i];
-        consumer->consume_events(event_strings);
-        consumer->check_expiry(now);
-        if (consumer->is_expired()) {
-            expired_consumers.push_back(consumer);
-            size_t last_index = _consumers.size() - 1;
-            if (i != last_index) {
-                _consumers[i] = _consumers[last_index];
-            } else {
-                ++i;
+namespace {
+    // split comma separated category names, ignoring surrounding spaces
+    std::vector<std::string> split_categories(const std::string& categories) {
+        std::vector<std::string> names;
+        size_t begin = 0;
+        for (;;) {
+            size_t end = categories.find(',', begin);
+            if (end == std::string::npos) {
+                end = categories.size();
             }
-            _consumers.pop_back();
-            if (_consumers.size() == 0) {
-                _enabled = false;
-                TEFLIB_TRACE_LOG("trace enabled={}\n", _enabled);
+            size_t first = begin;
+            size_t last = end;
+            while (first < last && categories[first] == ' ') {
+                ++first;
             }
-            continue;
+            while (last > first && categories[last - 1] == ' ') {
+                --last;
+            }
+            names.push_back(categories.substr(first, last - first));
+            if (end == categories.size()) {
+                break;
+            }
+            begin = end + 1;
         }
-        ++i;
+        return names;
     }
+}
 
-    // complete expired consumers with meta_events
-    if (expired_consumers.size() > 0) {
-        // copy meta_events under lock
-        std::vector<std::string> meta_events;
-        {
-            // Note: we're locking _event_mutex under _consumer_mutex
-            // which means we must never lock them in reverse order elsewhere
-            // or risk deadlock.
-            std::lock_guard<std::mutex> lock(_event_mutex);
-            meta_events = _meta_events;
-        }
-        // feed meta_events to consumers
-        for (size_t i = 0; i < expired_consumers.size(); ++i) {
-            Tracer::Consumer* consumer = expired_consumers[i];
-            consumer->finish(meta_events);
+Category_mask Tracer::get_category_mask(const std::string& categories) {
+    constexpr uint32_t NUM_BITS = 64;
+    std::vector<std::string> names = split_categories(categories);
+    Category_mask mask = 0;
+    std::lock_guard<std::mutex> lock(_strings_mutex);
+    for (const std::string& name : names) {
+        auto itr = _category_bits.find(name);
+        uint32_t bit;
+        if (itr != _category_bits.end()) {
+            bit = itr->second;
+        } else {
+            bit = std::min((uint32_t)(_category_bits.size()), NUM_BITS - 1);
+            _category_bits[name] = bit;
         }
+        mask |= Category_mask(1) << bit;
     }
+    return mask;
 }
 
-// call this for clean shutdown of active consumers
-void Tracer::shutdown() {
-    {
-        std::lock_guard<std::mutex> lock(_consumer_mutex);
-        for (size_t i = 0; i < _consumers.size(); ++i) {
-            _consumers[i]->update_expiry(0);
+void Tracer::set_sampling(const std::string& categories, uint32_t rate) {
+    if (rate == 0) {
+        rate = 1;
+    }
+    Category_mask mask = get_category_mask(categories);
+    uint64_t threshold = UINT64_MAX / rate;
+    for (uint32_t bit = 0; bit < 64; ++bit) {
+        if (mask & (Category_mask(1) << bit)) {
+            _sample_thresholds[bit].store(threshold, std::memory_order_relaxed);
         }
     }
-    advance_consumers();
+    if (rate > 1) {
+        _sampled_categories.fetch_or(mask, std::memory_order_relaxed);
+    } else {
+        _sampled_categories.fetch_and(~mask, std::memory_order_relaxed);
+    }
+
+    // record the rates with the meta_events, replacing old ones
+    std::vector<std::string> names = split_categories(categories);
+    for (const std::string& name : names) {
+        std::string escaped_name;
+        append_escaped(escaped_name, name);
+        std::string event = "{\"name\":\"sample_rate\",\"ph\":\"M\",\"pid\":" + _pid_str + ",\"tid\":0,\"args\":{\"cat\":\"";
+        event.append(escaped_name);
+        event.append("\",\"rate\":");
+        append_uint(event, rate);
+        event.append("}}");
+        set_meta_event("sample_rate/" + name, event);
+    }
 }
 
-void Tracer::add_consumer(Tracer::Consumer* consumer) {
-    if (consumer) {
-        consumer->update_expiry(get_now_msec());
-        std::lock_guard<std::mutex> lock(_consumer_mutex);
-        _consumers.push_back(consumer);
-        if (!_enabled.load()) {
-            _enabled = true;
-            TEFLIB_TRACE_LOG("trace enabled={}\n", _enabled);
-        }
+void Tracer::Consumer::set_categories(const std::string& categories) {
+    if (categories.empty() || categories == "*") {
+        _categories = ALL_CATEGORIES;
+    } else {
+        _categories = Tracer::instance().get_category_mask(categories);
     }
 }
 
-void Tracer::remove_consumer(Tracer::Consumer* consumer) {
-    // Note: no need to call this unless you're closing the consumer early
-    // (e.g. before is_complete)
-    std::lock_guard<std::mutex> lock(_consumer_mutex);
-    size_t i = 0;
-    while (i < _consumers.size()) {
-        if (consumer == _consumers[i]) {
-            size_t last_index = _consumers.size() - 1;
-            if (i != last_index) {
-                _consumers[i] = _consumers[last_index];
-            } else {
-                ++i;
-            }
-            _consumers.pop_back();
-            continue;
+std::string Tracer::get_string(String_id id) const {
+    std::lock_guard<std::mutex> lock(_strings_mutex);
+    if (id < _strings.size()) {
+        return _strings[id];
+    }
+    return std::string();
+}
+
+Arg tef::make_arg(String_id key, const std::string& value) {
+    Arg arg;
+    arg.key = key;
+    arg.type = Arg::STRING;
+    arg.value.str = Tracer::instance().intern(value);
+    return arg;
+}
+
+Arg tef::make_arg(String_id key, const char* value) {
+    return make_arg(key, std::string(value ? value : ""));
+}
+
+void Tracer::next_chunk(Thread_buffer& buffer) {
+    if (buffer.ring.empty()) {
+        // tail is full: hand it over to the harvester and start another,
+        // preferably one the harvester has given back
+        Event_chunk* chunk = buffer.spare_chunks;
+        if (!chunk) {
+            chunk = buffer.free_chunks.exchange(nullptr, std::memory_order_acquire);
         }
-        ++i;
+        if (chunk) {
+            buffer.spare_chunks = chunk->next.load(std::memory_order_relaxed);
+            chunk->next.store(nullptr, std::memory_order_relaxed);
+            chunk->num_events.store(0, std::memory_order_relaxed);
+        } else {
+            chunk = new Event_chunk;
+            _chunks_allocated.fetch_add(1, std::memory_order_relaxed);
+        }
+        buffer.tail->next.store(chunk, std::memory_order_release);
+        buffer.tail = chunk;
+    } else {
+        // overwrite the oldest chunk in the ring
+        // Note: the generation must be visible to readers before any of
+        // the overwrites, hence the fence.
+        buffer.ring_index = (buffer.ring_index + 1) % (uint32_t)(buffer.ring.size());
+        Event_chunk* chunk = buffer.ring[buffer.ring_index];
+        ++buffer.generation;
+        chunk->generation.store(buffer.generation, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        chunk->num_events.store(0, std::memory_order_relaxed);
+        buffer.tail = chunk;
+    }
+    buffer.write_index = 0;
+    buffer.num_args = 0;
+    buffer.text_size = 0;
+}
+
+void Tracer::recycle_chunk(Thread_buffer& buffer, Event_chunk* chunk, uint32_t max_free_chunks) {
+    // Note: call this under _buffers_mutex, once the producer has moved on
+    // from chunk.  Beyond max_free_chunks (or a few) waiting it is freed.
+    constexpr uint32_t MIN_FREE_CHUNKS = 4;
+    Event_chunk* top = buffer.free_chunks.load(std::memory_order_relaxed);
+    if (!top) {
+        buffer.num_free_chunks = 0; // the producer took them
     }
-    if (_consumers.size() == 0) {
-        _enabled = false;
-        TEFLIB_TRACE_LOG("trace enabled={}\n", _enabled);
+    if (buffer.num_free_chunks >= std::max(max_free_chunks, MIN_FREE_CHUNKS)) {
+        delete chunk;
+        return;
     }
+    do {
+        chunk->next.store(top, std::memory_order_relaxed);
+    } while (!buffer.free_chunks.compare_exchange_weak(top, chunk,
+                std::memory_order_release, std::memory_order_relaxed));
+    ++buffer.num_free_chunks;
 }
 
-Trace_to_file::Trace_to_file(uint64_t lifetime, const std::string& filename)
-    : Tracer::Consumer(lifetime), _file(filename)
+void Tracer::push_event(
+        String_id name,
+        String_id cat,
+        Phase ph,
+        uint64_t ts,
+        uint64_t dur,
+        const Arg* args,
+        uint32_t num_args,
+        const std::string* json)
 {
-    _stream.open(_file);
-    if (!_stream.is_open()) {
-        TEFLIB_TRACE_LOG("failed to open trace file='{}'\n", _file);
-        _file.clear();
-    } else {
-        TEFLIB_TRACE_LOG("opened trace='{}'\n", _file);
-        _stream << "{\"traceEvents\":[\n";
+    uint32_t text_size = 0;
+    if (json) {
+        text_size = (uint32_t)(json->size());
+        if (text_size > Event_chunk::TEXT_CAPACITY) {
+            // too big to ever fit in a chunk: drop it
+            _args_dropped.fetch_add(1, std::memory_order_relaxed);
+            text_size = 0;
+            json = nullptr;
+        }
+    }
+    // the JSON text takes the last arg
+    uint32_t max_typed_args = json ? MAX_EVENT_ARGS - 1 : MAX_EVENT_ARGS;
+    if (num_args > max_typed_args) {
+        _args_dropped.fetch_add(num_args - max_typed_args, std::memory_order_relaxed);
+        num_args = max_typed_args;
+    }
+    if (json) {
+        ++num_args;
     }
-}
 
-void Trace_to_file::consume_events(const std::vector<std::string>& events) {
-    if (_stream.is_open()) {
-        for (const auto& event : events) {
-            _stream << event << ",\n";
+    Thread_buffer& buffer = get_thread_buffer();
+    if (buffer.write_index == Event_chunk::CAPACITY
+            || buffer.num_args + num_args > Event_chunk::ARGS_CAPACITY
+            || buffer.text_size + text_size > Event_chunk::TEXT_CAPACITY) {
+        next_chunk(buffer);
+    }
+    Event_chunk* chunk = buffer.tail;
+    uint32_t args_begin = buffer.num_args;
+    if (num_args > 0) {
+        Arg* arg = chunk->args + buffer.num_args;
+        uint32_t num_typed_args = json ? num_args - 1 : num_args;
+        for (uint32_t i = 0; i < num_typed_args; ++i) {
+            *arg = args[i];
+            ++arg;
         }
+        if (json) {
+            memcpy(chunk->text + buffer.text_size, json->data(), text_size);
+            arg->key = 0;
+            arg->type = Arg::JSON;
+            arg->value.text.offset = buffer.text_size;
+            arg->value.text.size = text_size;
+            buffer.text_size += text_size;
+        }
+        buffer.num_args += num_args;
     }
+    uint16_t depth = (uint16_t)(std::min<uint32_t>(scope_depth(), UINT16_MAX));
+    chunk->events[buffer.write_index] = {ts, dur, name, cat, args_begin, (uint8_t)num_args, ph, depth};
+    ++buffer.write_index;
+    chunk->num_events.store(buffer.write_index, std::memory_order_release);
 }
 
-void Trace_to_file::finish(const std::vector<std::string>& meta_events) {
-    Tracer::Consumer::finish(meta_events);
-    if (_stream.is_open()) {
-        // TRICK: end with bogus "complete" event sans ending comma
-        // (this simplifies consume_event() logic)
-        std::string tid_str = Tracer::thread_id_as_string();
-        uint64_t ts = Tracer::instance().now();
-#ifdef NO_FMT
-        std::string bogus_event = "{\"name\":\"end_of_trace\",\"ph\":\"X\",\"pid\":1,\"tid\":";
-        std::ostringstream ss;
-        ss << tid_str << ",\"ts\":" << ts << ",\"dur\":" << 1000 << "}";
-        bogus_event.append(ss.str());
-#else
-        std::string bogus_event = fmt::format(
-            "{{\"name\":\"end_of_trace\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{},\"dur\":1000}}",
-            tid_str, ts);
-#endif // NO_FMT
-        _stream << bogus_event << "\n]\n}\n"; // close array instead of comma
+void Tracer::add_event(String_id name, String_id cat, Phase ph, uint64_t ts, uint64_t dur) {
+    if (is_category_enabled(cat)) {
+        if (ts == 0)
+        {
+            ts = Tracer::instance().now();
+        }
+        push_event(name, cat, ph, ts, dur, nullptr, 0, nullptr);
+    }
+}
 
-        _stream.close();
-        TEFLIB_TRACE_LOG("closed trace='{}'\n", _file);
+void Tracer::add_event_with_id(String_id name, String_id cat, Phase ph, uint64_t id, uint64_t ts) {
+    if (is_category_enabled(cat) && has_id(ph)) {
+        if (ts == 0)
+        {
+            ts = now();
+        }
+        push_event(name, cat, ph, ts, id, nullptr, 0, nullptr);
+    }
+}
+
+void Tracer::add_event_with_args(
+        String_id name,
+        String_id cat,
+        Phase ph,
+        const Arg* args,
+        uint32_t num_args,
+        uint64_t ts,
+        uint64_t dur)
+{
+    if (is_category_enabled(cat)) {
+        if (ts == 0)
+        {
+            ts = Tracer::instance().now();
+        }
+        push_event(name, cat, ph, ts, dur, args, num_args, nullptr);
+    }
+}
+
+void Tracer::add_event_with_args(
+        String_id name,
+        String_id cat,
+        Phase ph,
+        const std::string& args,
+        uint64_t ts,
+        uint64_t dur)
+{
+    add_event_with_args(name, cat, ph, nullptr, 0, args, ts, dur);
+}
+
+void Tracer::add_event_with_args(
+        String_id name,
+        String_id cat,
+        Phase ph,
+        const Arg* args,
+        uint32_t num_args,
+        const std::string& json_args,
+        uint64_t ts,
+        uint64_t dur)
+{
+    if (is_category_enabled(cat)) {
+        if (ts == 0)
+        {
+            ts = Tracer::instance().now();
+        }
+        // we store the args without their enclosing braces
+        // so they can be merged with any typed args
+        std::string json;
+        if (json_args.size() > 1 && json_args.front() == '{' && json_args.back() == '}') {
+            json = json_args.substr(1, json_args.size() - 2);
+        } else {
+            json = json_args;
+        }
+        push_event(name, cat, ph, ts, dur, args, num_args, json.empty() ? nullptr : &json);
+    }
+}
+
+void Tracer::set_counter(
+        String_id name,
+        String_id cat,
+        int64_t count)
+{
+    if (is_category_enabled(cat)) {
+        // counter args are keyed by the counter name
+        Arg arg = make_arg(name, count);
+        push_event(name, cat, Phase::Counter, now(), 0, &arg, 1, nullptr);
+    }
+}
+
+void Tracer::set_counters(
+        String_id name,
+        String_id cat,
+        const Arg* series,
+        uint32_t num_series)
+{
+    if (is_category_enabled(cat)) {
+        push_event(name, cat, Phase::Counter, now(), 0, series, num_series, nullptr);
+    }
+}
+
+void Tracer::add_event(const std::string& name, const std::string& cat, Phase ph, uint64_t ts, uint64_t dur) {
+    if (is_enabled()) {
+        add_event(intern(name), intern(cat), ph, ts, dur);
+    }
+}
+
+void Tracer::add_event_with_args(
+        const std::string& name,
+        const std::string& cat,
+        Phase ph,
+        const std::string& args,
+        uint64_t ts,
+        uint64_t dur)
+{
+    if (is_enabled()) {
+        add_event_with_args(intern(name), intern(cat), ph, args, ts, dur);
+    }
+}
+
+void Tracer::set_counter(
+        const std::string& name,
+        const std::string& cat,
+        int64_t count)
+{
+    if (is_enabled()) {
+        set_counter(intern(name), intern(cat), count);
+    }
+}
+
+namespace {
+    std::string make_meta_event(const std::string& pid, const std::string& type, const std::string& tid,
+            const std::string& args) {
+        std::string event = "{\"name\":\"";
+        event.append(type);
+        event.append("\",\"ph\":\"M\",\"pid\":");
+        event.append(pid);
+        event.append(",\"tid\":");
+        event.append(tid);
+        event.append(",\"args\":{");
+        event.append(args);
+        event.append("}}");
+        return event;
+    }
+}
+
+void Tracer::set_meta_event(const std::string& key, const std::string& event) {
+    // replace the last event with this key
+    std::lock_guard<std::mutex> lock(_meta_mutex);
+    auto itr = _meta_event_index.find(key);
+    if (itr != _meta_event_index.end()) {
+        _meta_events[itr->second] = event;
+    } else {
+        _meta_event_index[key] = _meta_events.size();
+        _meta_events.push_back(event);
+    }
+}
+
+void Tracer::set_clock_sync_event() {
+    // ts 0 is when _clock was created
+    append_clock_sync_json(_clock_sync_event, _pid_str, 0, USEC_PER_SECOND, _clock.get_origin_nsec());
+    set_meta_event("clock_sync", _clock_sync_event);
+}
+
+void Tracer::add_meta_event(const std::string& type, const std::string& arg) {
+    // Note: 'type' has a finite set of acceptable values
+    //   process_name
+    //   process_labels
+    //   thread_name
+    std::string arg_name;
+    if (type == "process_name") {
+        arg_name = "name";
+    } else if (type == "process_labels") {
+        arg_name = "labels";
+    } else if (type == "thread_name") {
+        arg_name = "name";
+    }
+    if (arg_name.empty()) {
+        return;
+    }
+    // meta_events get formatted to strings immediately
+    std::string args = "\"";
+    args.append(arg_name);
+    args.append("\":\"");
+    append_escaped(args, arg);
+    args.push_back('"');
+    if (type == "thread_name") {
+        std::string event = make_meta_event(_pid_str, type, thread_id_as_string(), args);
+        Thread_record& record = get_thread_record();
+        std::lock_guard<std::mutex> lock(_meta_mutex);
+        record.name_event = event;
+        record.version = ++_thread_meta_version;
+    } else {
+        set_meta_event(type, make_meta_event(_pid_str, type, "0", args));
+    }
+}
+
+void Tracer::add_meta_event(const std::string& type, uint32_t arg) {
+    // Note: 'type' has a finite set of acceptable values
+    //   process_sort_index
+    //   thread_sort_index
+    if (type != "process_sort_index" && type != "thread_sort_index") {
+        return;
+    }
+    std::string args = "\"sort_index\":";
+    append_uint(args, arg);
+    if (type == "thread_sort_index") {
+        std::string event = make_meta_event(_pid_str, type, thread_id_as_string(), args);
+        Thread_record& record = get_thread_record();
+        std::lock_guard<std::mutex> lock(_meta_mutex);
+        record.sort_index_event = event;
+        record.version = ++_thread_meta_version;
+    } else {
+        set_meta_event(type, make_meta_event(_pid_str, type, "0", args));
+    }
+}
+
+// get_thread_meta_events() appends the thread metadata changed since
+// since_version and returns the version it is up to date with
+uint64_t Tracer::get_thread_meta_events(uint64_t since_version, std::vector<std::string>& meta_events) const {
+    std::lock_guard<std::mutex> lock(_meta_mutex);
+    for (const Thread_record* record : _thread_records) {
+        if (record->version > since_version) {
+            if (!record->name_event.empty()) {
+                meta_events.push_back(record->name_event);
+            }
+            if (!record->sort_index_event.empty()) {
+                meta_events.push_back(record->sort_index_event);
+            }
+        }
+    }
+    return _thread_meta_version;
+}
+
+void Tracer::send_thread_meta_events(const std::vector<Consumer*>& consumers) {
+    uint64_t version;
+    {
+        std::lock_guard<std::mutex> lock(_meta_mutex);
+        version = _thread_meta_version;
+    }
+    std::vector<std::string> meta_events;
+    for (Consumer* consumer : consumers) {
+        if (consumer->_thread_meta_version < version) {
+            meta_events.clear();
+            consumer->_thread_meta_version = get_thread_meta_events(consumer->_thread_meta_version, meta_events);
+            if (!meta_events.empty()) {
+                consumer->consume_meta_events(meta_events);
+            }
+        }
+    }
+}
+
+void Tracer::remove_exited_thread_records() {
+    // Consumers have had the metadata of exited threads (and their last
+    // events are harvested) so only a few are kept, for flight recorder
+    // snapshots and for consumers added later.
+    constexpr size_t MAX_EXITED_THREAD_RECORDS = 64;
+    std::lock_guard<std::mutex> lock(_meta_mutex);
+    size_t num_exited = 0;
+    size_t i = _thread_records.size();
+    while (i-- > 0) {
+        Thread_record* record = _thread_records[i];
+        if (record->exited.load(std::memory_order_acquire) && ++num_exited > MAX_EXITED_THREAD_RECORDS) {
+            delete record;
+            _thread_records.erase(_thread_records.begin() + i);
+        }
+    }
+}
+
+size_t Tracer::get_num_events() const {
+    size_t num_events = 0;
+    std::lock_guard<std::mutex> lock(_buffers_mutex);
+    for (size_t i = 0; i < _buffers.size(); ++i) {
+        const Thread_buffer* buffer = _buffers[i];
+        for (size_t j = 0; j < buffer->ring.size(); ++j) {
+            num_events += buffer->ring[j]->num_events.load(std::memory_order_acquire);
+        }
+        uint32_t read_index = buffer->read_index;
+        const Event_chunk* chunk = buffer->head;
+        while (chunk) {
+            num_events += chunk->num_events.load(std::memory_order_acquire) - read_index;
+            read_index = 0;
+            chunk = chunk->next.load(std::memory_order_acquire);
+        }
+    }
+    return num_events;
+}
+
+void Tracer::enable_flight_recorder(uint32_t chunks_per_thread) {
+    std::lock_guard<std::mutex> lock(_consumer_mutex);
+    if (_ring_size == 0 && chunks_per_thread > 0) {
+        // Note: a ring needs at least two chunks else a writer would
+        // always be overwriting the only chunk a snapshot could read
+        _ring_size = chunks_per_thread < 2 ? 2 : chunks_per_thread;
+        update_enabled();
+    }
+}
+
+bool Tracer::request_snapshot(Consumer* consumer, uint64_t window) {
+    uint8_t expected = SNAPSHOT_IDLE;
+    if (!_snapshot_state.compare_exchange_strong(expected, SNAPSHOT_CLAIMED)) {
+        return false;
+    }
+    _snapshot_consumer = consumer;
+    _snapshot_window = window;
+    _snapshot_state.store(SNAPSHOT_PENDING, std::memory_order_release);
+    return true;
+}
+
+void Tracer::update_enabled() {
+    // Note: call this under _consumer_mutex
+    Category_mask enabled = _ring_size > 0 ? ALL_CATEGORIES : 0;
+    for (const Consumer* consumer : _consumers) {
+        enabled |= consumer->get_categories();
+    }
+    if (enabled != _enabled_categories.load()) {
+        _enabled_categories = enabled;
+        TEFLIB_TRACE_LOG("trace enabled categories={:x}\n", enabled);
+    }
+}
+
+void Tracer::harvest_events(Harvest& harvest) {
+    std::vector<Event>& events = harvest.events;
+    std::vector<Arg>& args = harvest.args;
+    std::string& text = harvest.text;
+    bool nsec = has_nanosecond_precision();
+    harvest.ts_units_per_second = nsec ? NSEC_PER_SECOND : USEC_PER_SECOND;
+    std::lock_guard<std::mutex> lock(_buffers_mutex);
+    size_t num_exited_rings = 0;
+    size_t i = 0;
+    while (i < _buffers.size()) {
+        Thread_buffer* buffer = _buffers[i];
+        // Note: we must check exited BEFORE draining, else we might miss
+        // events written between the drain and the check.
+        bool exited = buffer->exited.load(std::memory_order_acquire);
+        if (!buffer->ring.empty()) {
+            // flight recorder buffers are never drained: we keep a few
+            // from exited threads around for the next snapshot
+            constexpr size_t MAX_EXITED_RINGS = 16;
+            if (exited && ++num_exited_rings > MAX_EXITED_RINGS) {
+                delete buffer;
+                _buffers.erase(_buffers.begin() + i);
+                continue;
+            }
+            ++i;
+            continue;
+        }
+        size_t begin = events.size();
+        uint32_t num_drained = 0;
+        for (;;) {
+            Event_chunk* chunk = buffer->head;
+            // Note: we load next BEFORE num_events: if the producer has
+            // already moved on then num_events is final.
+            Event_chunk* next = chunk->next.load(std::memory_order_acquire);
+            uint32_t num_events = chunk->num_events.load(std::memory_order_acquire);
+            for (uint32_t j = buffer->read_index; j < num_events; ++j) {
+                Event event = chunk->events[j];
+                // copy args and rebase their indices/offsets into our buffers
+                const Arg* arg = chunk->args + event.args_begin;
+                event.args_begin = (uint32_t)(args.size());
+                for (uint32_t k = 0; k < event.num_args; ++k) {
+                    args.push_back(arg[k]);
+                    if (arg[k].type == Arg::JSON) {
+                        Arg& json_arg = args.back();
+                        json_arg.value.text.offset = (uint32_t)(text.size());
+                        text.append(chunk->text + arg[k].value.text.offset, arg[k].value.text.size);
+                    }
+                }
+                events.push_back(event);
+            }
+            buffer->read_index = num_events;
+            if (!next) {
+                break;
+            }
+            // producer has moved on: chunk is ours to give back
+            buffer->head = next;
+            ++num_drained;
+            recycle_chunk(*buffer, chunk, std::max(num_drained, buffer->num_drained_chunks));
+            buffer->read_index = 0;
+        }
+        buffer->num_drained_chunks = num_drained;
+        if (events.size() > begin) {
+            export_times(events.data() + begin, events.size() - begin, buffer->export_time, nsec);
+            harvest.ranges.push_back({buffer->tid, events.size()});
+        }
+        if (exited) {
+            delete buffer;
+            size_t last_index = _buffers.size() - 1;
+            if (i != last_index) {
+                _buffers[i] = _buffers[last_index];
+            }
+            _buffers.pop_back();
+            continue;
+        }
+        ++i;
+    }
+}
+
+void Tracer::copy_flight_recorder(Harvest& harvest, uint64_t since) {
+    // Note: producers may overwrite a chunk while we copy it.  We copy first
+    // and then check the chunk's generation: if it changed we discard the
+    // copy.  Until validated the copied data may be garbage so all indices
+    // read from it are clamped.
+    struct Chunk_copy {
+        uint64_t generation;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<Chunk_copy> copies;
+    std::vector<Event> events;
+    bool nsec = has_nanosecond_precision();
+    harvest.ts_units_per_second = nsec ? NSEC_PER_SECOND : USEC_PER_SECOND;
+    std::lock_guard<std::mutex> lock(_buffers_mutex);
+    for (size_t i = 0; i < _buffers.size(); ++i) {
+        const Thread_buffer* buffer = _buffers[i];
+        copies.clear();
+        events.clear();
+        for (size_t j = 0; j < buffer->ring.size(); ++j) {
+            const Event_chunk* chunk = buffer->ring[j];
+            uint64_t generation = chunk->generation.load(std::memory_order_acquire);
+            if (generation == 0) {
+                continue;
+            }
+            uint32_t num_events = chunk->num_events.load(std::memory_order_acquire);
+            if (num_events > Event_chunk::CAPACITY) {
+                num_events = Event_chunk::CAPACITY;
+            }
+            size_t begin = events.size();
+            size_t args_begin = harvest.args.size();
+            size_t text_begin = harvest.text.size();
+            for (uint32_t k = 0; k < num_events; ++k) {
+                Event event = chunk->events[k];
+                if (event.args_begin > Event_chunk::ARGS_CAPACITY
+                        || event.num_args > Event_chunk::ARGS_CAPACITY - event.args_begin) {
+                    event.num_args = 0;
+                }
+                const Arg* arg = chunk->args + event.args_begin;
+                event.args_begin = (uint32_t)(harvest.args.size());
+                for (uint32_t n = 0; n < event.num_args; ++n) {
+                    harvest.args.push_back(arg[n]);
+                    if (arg[n].type == Arg::JSON) {
+                        Arg& json_arg = harvest.args.back();
+                        uint32_t offset = json_arg.value.text.offset;
+                        uint32_t size = json_arg.value.text.size;
+                        if (offset > Event_chunk::TEXT_CAPACITY || size > Event_chunk::TEXT_CAPACITY - offset) {
+                            size = 0;
+                        }
+                        json_arg.value.text.offset = (uint32_t)(harvest.text.size());
+                        json_arg.value.text.size = size;
+                        harvest.text.append(chunk->text + offset, size);
+                    }
+                }
+                events.push_back(event);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (chunk->generation.load(std::memory_order_relaxed) != generation) {
+                // overwritten while we were copying
+                events.resize(begin);
+                harvest.args.resize(args_begin);
+                harvest.text.resize(text_begin);
+                continue;
+            }
+            copies.push_back({generation, begin, events.size()});
+        }
+
+        // put this thread's chunks back in order and keep the recent events
+        std::sort(copies.begin(), copies.end(),
+            [](const Chunk_copy& a, const Chunk_copy& b) { return a.generation < b.generation; });
+        size_t begin = harvest.events.size();
+        for (size_t j = 0; j < copies.size(); ++j) {
+            for (size_t k = copies[j].begin; k < copies[j].end; ++k) {
+                if (events[k].ts >= since) {
+                    harvest.events.push_back(events[k]);
+                }
+            }
+        }
+        if (harvest.events.size() > begin) {
+            Export_time export_time;
+            export_times(harvest.events.data() + begin, harvest.events.size() - begin, export_time, nsec);
+            harvest.ranges.push_back({buffer->tid, harvest.events.size()});
+        }
+    }
+}
+
+void Tracer::export_times(Event* events, size_t num_events, Export_time& state, bool nsec) const {
+    // Convert ts and dur from ticks to usec (or nsec).
+    //
+    // BUG: chrome://tracing sometimes won't correctly organize embedded
+    // events with simultaneous start times!
+    // WORKAROUND: ticks are distinct on each thread but may round to the
+    // same usec (or nsec), so we nudge timestamps (per thread) until every
+    // start and end is distinct and in tick order: siblings don't overlap
+    // and children stay strictly inside their parents.  This introduces
+    // slight error on measurements.
+    //
+    // Events arrive in recorded order, which is tick order for all but the
+    // starts of Complete events: a scope is recorded when it ends, after
+    // its children.  So ends and other events just follow the latest time
+    // exported, and a late start goes after the latest time exported at its
+    // depth or shallower (before it started) and before the earliest one
+    // deeper since then (its children).  Every time also leaves a unit
+    // free for each scope opened since the previous time (the starts still
+    // to come).
+    constexpr uint32_t MAX_DEPTH = Export_time::MAX_DEPTH;
+    constexpr uint64_t NONE = Export_time::NONE;
+    const Clock& clock = _clock;
+    auto convert = [&clock, nsec](uint64_t ticks) { return nsec ? clock.to_nsec(ticks) : clock.to_usec(ticks); };
+    // earliest time for a point with depth scopes open before it, after
+    // time with open scopes open after it
+    auto after = [](uint64_t time, uint32_t open, uint32_t depth) {
+        uint64_t room = depth > open ? depth - open : 0;
+        return time == NONE ? room : time + room + 1;
+    };
+    auto add = [&state](uint64_t time, uint32_t depth, uint32_t open) {
+        for (; state.num_depths <= depth; ++state.num_depths) {
+            state.last[state.num_depths] = NONE;
+            state.first[state.num_depths] = NONE;
+        }
+        if (state.last[depth] == NONE || time > state.last[depth]) {
+            state.last[depth] = time;
+            state.last_open[depth] = open;
+        }
+        for (uint32_t d = 0; d <= depth; ++d) {
+            state.first[d] = std::min(state.first[d], time);
+        }
+        for (uint32_t d = depth + 1; d < state.num_depths; ++d) {
+            state.first[d] = NONE;
+        }
+        if (state.end == NONE || time > state.end) {
+            state.end = time;
+            state.end_open = open;
+        }
+    };
+    for (size_t i = 0; i < num_events; ++i) {
+        Event& event = events[i];
+        uint32_t depth = std::min<uint32_t>(event.depth, MAX_DEPTH - 1);
+        uint64_t ts = convert(event.ts);
+        if (event.ph == Phase::Complete) {
+            uint64_t prev = NONE;
+            uint32_t prev_open = 0;
+            for (uint32_t d = 0; d <= depth && d < state.num_depths; ++d) {
+                if (state.last[d] != NONE && (prev == NONE || state.last[d] > prev)) {
+                    prev = state.last[d];
+                    prev_open = state.last_open[d];
+                }
+            }
+            uint64_t min_ts = after(prev, prev_open, depth);
+            if (depth + 1 < state.num_depths && state.first[depth + 1] != NONE) {
+                ts = std::min(ts, state.first[depth + 1] - 1);
+            }
+            ts = std::max(ts, min_ts);
+            add(ts, depth, depth + 1);
+            uint64_t end = std::max(convert(event.ts + event.dur), after(state.end, state.end_open, 0));
+            add(end, depth, depth);
+            event.dur = end - ts;
+        } else {
+            ts = std::max(ts, after(state.end, state.end_open, depth));
+            if (!has_id(event.ph)) {
+                event.dur = convert(event.ts + event.dur) - convert(event.ts);
+            }
+            add(ts, depth, depth);
+        }
+        event.ts = ts;
+    }
+}
+
+void Tracer::sort_events(Harvest& harvest) {
+    // Sort each thread's events by ts (as indices, in _sort_order) and
+    // then merge the threads, taking the earliest next event each time.
+    // export_times() has already made each thread's ts distinct with its
+    // scopes nested, so equal ts on a thread only come from events given
+    // explicit timestamps: then the longer Complete event comes first
+    // since it encloses the other, and otherwise the recorded order is
+    // kept.
+    const std::vector<Event>& events = harvest.events;
+    std::vector<size_t>& order = _sort_order;
+    order.resize(events.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    auto before = [&events](size_t a, size_t b) {
+        const Event& x = events[a];
+        const Event& y = events[b];
+        if (x.ts != y.ts) {
+            return x.ts < y.ts;
+        }
+        uint64_t x_dur = x.ph == Phase::Complete ? x.dur : 0;
+        uint64_t y_dur = y.ph == Phase::Complete ? y.dur : 0;
+        if (x_dur != y_dur) {
+            return x_dur > y_dur;
+        }
+        return a < b;
+    };
+    std::vector<Merge_cursor>& cursors = _merge_cursors;
+    cursors.clear();
+    bool in_order = true;
+    size_t begin = 0;
+    for (size_t i = 0; i < harvest.ranges.size(); ++i) {
+        size_t end = harvest.ranges[i].end;
+        if (!std::is_sorted(order.begin() + begin, order.begin() + end, before)) {
+            std::sort(order.begin() + begin, order.begin() + end, before);
+            in_order = false;
+        }
+        if (end > begin) {
+            cursors.push_back({begin, end, i});
+        }
+        begin = end;
+    }
+    if (in_order && cursors.size() <= 1) {
+        return;
+    }
+
+    // heap of cursors, earliest next event on top
+    auto later = [&order, &before](const Merge_cursor& a, const Merge_cursor& b) {
+        return before(order[b.next], order[a.next]);
+    };
+    std::make_heap(cursors.begin(), cursors.end(), later);
+    _sorted_events.clear();
+    _sorted_ranges.clear();
+    while (!cursors.empty()) {
+        std::pop_heap(cursors.begin(), cursors.end(), later);
+        Merge_cursor& cursor = cursors.back();
+        // take this thread's events until another thread's is earlier
+        do {
+            _sorted_events.push_back(events[order[cursor.next]]);
+            ++cursor.next;
+        } while (cursor.next < cursor.end
+            && (cursors.size() == 1 || !later(cursor, cursors.front())));
+        _sorted_ranges.push_back({harvest.ranges[cursor.range].tid, _sorted_events.size()});
+        if (cursor.next < cursor.end) {
+            std::push_heap(cursors.begin(), cursors.end(), later);
+        } else {
+            cursors.pop_back();
+        }
+    }
+    // Note: swapping keeps the capacity of both
+    harvest.events.swap(_sorted_events);
+    harvest.ranges.swap(_sorted_ranges);
+}
+
+void Tracer::update_strings() {
+    // catch up on strings interned since last harvest
+    std::lock_guard<std::mutex> lock(_strings_mutex);
+    if (_harvest_strings->size() == _strings.size()) {
+        return;
+    }
+    if (_harvest_strings.use_count() > 1) {
+        // a consumer still holds a batch using these: copy on write
+        _harvest_strings = std::make_shared<std::vector<std::string>>(*_harvest_strings);
+    }
+    for (size_t i = _harvest_strings->size(); i < _strings.size(); ++i) {
+        _harvest_strings->push_back(_strings[i]);
+        _harvest_json_strings.push_back(std::string());
+        append_escaped(_harvest_json_strings.back(), _strings[i]);
+    }
+}
+
+void Tracer::serialize_events(const Harvest& harvest, std::string& json, std::vector<size_t>& ends) {
+    json.clear();
+    ends.clear();
+    size_t num_events = harvest.events.size();
+    std::unique_lock<std::mutex> lock(_serializer_mutex);
+    if (_serializer_slices.size() < 2 || num_events < _serializer_min_events) {
+        lock.unlock();
+        serialize_range(harvest, 0, num_events, json, ends);
+        return;
+    }
+
+    // hand out the slices and take our share of them
+    size_t num_slices = _serializer_slices.size();
+    for (size_t i = 0; i < num_slices; ++i) {
+        _serializer_slices[i].begin = num_events * i / num_slices;
+        _serializer_slices[i].end = num_events * (i + 1) / num_slices;
+    }
+    _serializer_harvest = &harvest;
+    _serializer_next_slice = 0;
+    _serializer_pending = num_slices;
+    ++_serializer_generation;
+    _serializer_start.notify_all();
+    serialize_slices(lock);
+    _serializer_done.wait(lock, [this] { return _serializer_pending == 0; });
+    _serializer_harvest = nullptr;
+
+    // concatenate them in order, rebasing ends
+    size_t size = 0;
+    for (const Serializer_slice& slice : _serializer_slices) {
+        size += slice.json.size();
+    }
+    json.reserve(size);
+    ends.reserve(num_events);
+    for (const Serializer_slice& slice : _serializer_slices) {
+        size_t offset = json.size();
+        json.append(slice.json);
+        for (size_t end : slice.ends) {
+            ends.push_back(offset + end);
+        }
+    }
+}
+
+void Tracer::serialize_slices(std::unique_lock<std::mutex>& lock) {
+    // claim and serialize slices until none are left
+    // Note: call this with lock (of _serializer_mutex) held
+    while (_serializer_next_slice < _serializer_slices.size()) {
+        Serializer_slice& slice = _serializer_slices[_serializer_next_slice++];
+        const Harvest& harvest = *_serializer_harvest;
+        lock.unlock();
+        slice.json.clear();
+        slice.ends.clear();
+        serialize_range(harvest, slice.begin, slice.end, slice.json, slice.ends);
+        lock.lock();
+        if (--_serializer_pending == 0) {
+            _serializer_done.notify_all();
+        }
+    }
+}
+
+void Tracer::run_serializer(uint64_t generation) {
+    // Note: generation is the last one started before this thread
+    std::unique_lock<std::mutex> lock(_serializer_mutex);
+    for (;;) {
+        _serializer_start.wait(lock, [this, &generation] {
+            return _serializer_stop || _serializer_generation != generation;
+        });
+        if (_serializer_stop) {
+            return;
+        }
+        generation = _serializer_generation;
+        serialize_slices(lock);
+    }
+}
+
+void Tracer::set_serializer_threads(uint32_t num_threads, size_t min_events) {
+    // Note: the harvest lock keeps serialize_events() out while we change threads
+    std::lock_guard<std::mutex> harvest_lock(_harvest_mutex);
+    stop_serializer_threads();
+    std::lock_guard<std::mutex> lock(_serializer_mutex);
+    _serializer_min_events = min_events;
+    if (num_threads < 2) {
+        return;
+    }
+    _serializer_slices.resize(num_threads);
+    _serializer_next_slice = num_threads; // none to claim yet
+    uint64_t generation = _serializer_generation;
+    for (uint32_t i = 1; i < num_threads; ++i) {
+        _serializer_threads.emplace_back([this, generation] { run_serializer(generation); });
+    }
+    TEFLIB_TRACE_LOG("serializing harvests of {}+ events on {} threads\n", min_events, num_threads);
+}
+
+void Tracer::stop_serializer_threads() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(_serializer_mutex);
+        _serializer_stop = true;
+        threads.swap(_serializer_threads);
+    }
+    _serializer_start.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::lock_guard<std::mutex> lock(_serializer_mutex);
+    _serializer_stop = false;
+    _serializer_slices.clear();
+}
+
+void Tracer::serialize_range(const Harvest& harvest, size_t begin, size_t end,
+        std::string& json, std::vector<size_t>& ends) const {
+    // For reference:
+    //
+    //   name = human readable name for the event
+    //   cat = comma separated strings used for filtering
+    //   ph = phase type
+    //   ts = timestamp
+    //   dur = duration
+    //   tid = thread_id
+    //   pid = process_id
+    //   args = JSON string of special info
+    //
+    // Events [begin, end) are appended to one contiguous buffer and ends
+    // gets the end of each.  Names and categories come pre-escaped from
+    // _harvest_json_strings.
+    const std::vector<Event>& events = harvest.events;
+    const std::vector<Thread_range>& ranges = harvest.ranges;
+    json.reserve(json.size() + (end - begin) * 128);
+    ends.reserve(ends.size() + (end - begin));
+    // start in the range of the thread that events[begin] belongs to
+    size_t range_index = std::upper_bound(ranges.begin(), ranges.end(), begin,
+            [](size_t i, const Thread_range& range) { return i < range.end; }) - ranges.begin();
+    const std::string* tid = nullptr;
+    for (size_t i = begin; i < end; ++i) {
+        while (i >= ranges[range_index].end) {
+            ++range_index;
+            tid = nullptr;
+        }
+        if (!tid) {
+            tid = &(_harvest_json_strings[ranges[range_index].tid]);
+        }
+        append_event_json(json, events[i], _pid_str, *tid, harvest.args.data(), harvest.text.data(),
+                _harvest_json_strings.data(), harvest.ts_units_per_second);
+        ends.push_back(json.size());
+        json.append(",\n");
+    }
+}
+
+std::shared_ptr<Tracer::Harvest_data> Tracer::get_harvest_data() {
+    // reuse the buffers of a recent harvest which no consumer still holds:
+    // a few are kept so that a consumer holding on to batches (e.g. a
+    // Queued_consumer) doesn't make every harvest allocate anew
+    constexpr size_t MAX_HARVEST_DATA = 4;
+    for (const std::shared_ptr<Harvest_data>& data : _harvest_data) {
+        if (data.use_count() == 1) {
+            // Note: clear() keeps capacity
+            data->harvest.clear();
+            data->json.clear();
+            data->ends.clear();
+            data->strings.reset();
+            return data;
+        }
+    }
+    std::shared_ptr<Harvest_data> data = std::make_shared<Harvest_data>();
+    if (_harvest_data.size() < MAX_HARVEST_DATA) {
+        _harvest_data.push_back(data);
+    }
+    return data;
+}
+
+Tracer::Batch Tracer::make_batch(const std::shared_ptr<Harvest_data>& data) const {
+    Batch batch = { data->json.data(), data->json.size(), data->ends.data(), data->ends.size(), data };
+    return batch;
+}
+
+Tracer::Raw_batch Tracer::make_raw_batch(const std::shared_ptr<Harvest_data>& data) const {
+    const Harvest& harvest = data->harvest;
+    Raw_batch batch = {
+        harvest.events.data(), harvest.events.size(),
+        harvest.ranges.data(), harvest.ranges.size(),
+        harvest.args.data(), harvest.text.data(),
+        data->strings->data(), data->strings->size(),
+        harvest.ts_units_per_second,
+        data
+    };
+    return batch;
+}
+
+void Tracer::take_snapshot(Consumer* consumer, uint64_t window) {
+    std::shared_ptr<Harvest_data> data = std::make_shared<Harvest_data>();
+    Harvest& harvest = data->harvest;
+    uint64_t t = now();
+    uint64_t window_ticks = _clock.usec_to_ticks(window * 1000);
+    uint64_t since = (window_ticks < t) ? t - window_ticks : 0;
+    copy_flight_recorder(harvest, since);
+    if (has_sorted_export()) {
+        sort_events(harvest);
+    }
+    update_strings();
+    data->strings = _harvest_strings;
+    if (consumer->get_format() == Consumer::RAW) {
+        if (!harvest.events.empty()) {
+            consumer->consume_raw(make_raw_batch(data));
+        }
+    } else {
+        serialize_events(harvest, data->json, data->ends);
+        if (!data->ends.empty()) {
+            consumer->consume_batch(make_batch(data));
+        }
+    }
+    std::vector<std::string> meta_events;
+    {
+        std::lock_guard<std::mutex> lock(_meta_mutex);
+        meta_events = _meta_events;
+    }
+    get_thread_meta_events(0, meta_events);
+    meta_events.push_back(get_stats_meta_event());
+    consumer->_state = Consumer::EXPIRED;
+    consumer->finish(meta_events);
+}
+
+void Tracer::start_harvester(uint64_t interval, uint64_t sample_interval) {
+    std::lock_guard<std::mutex> lock(_harvester_mutex);
+    if (!_harvester.joinable()) {
+        _harvester_stop = false;
+        _harvester_running = true;
+        _harvester = std::thread([this, interval, sample_interval] {
+            run_harvester(interval, sample_interval);
+        });
+    }
+}
+
+void Tracer::stop_harvester() {
+    std::thread harvester;
+    {
+        std::lock_guard<std::mutex> lock(_harvester_mutex);
+        if (!_harvester.joinable()) {
+            return;
+        }
+        _harvester_stop = true;
+        harvester.swap(_harvester);
+    }
+    _harvester_condition.notify_all();
+    harvester.join();
+    _harvester_running = false;
+}
+
+void Tracer::run_harvester(uint64_t interval, uint64_t sample_interval) {
+    // calibrate here, rather than in the first harvest that needs it
+    _clock.calibrate();
+    typedef std::chrono::steady_clock clock;
+    const clock::duration harvest_period = std::chrono::milliseconds(interval);
+    const clock::duration sample_period = std::chrono::microseconds(sample_interval);
+    clock::time_point next_harvest = clock::now() + harvest_period;
+    clock::time_point next_sample = clock::now() + sample_period;
+    std::unique_lock<std::mutex> lock(_harvester_mutex);
+    while (!_harvester_stop) {
+        _harvester_condition.wait_until(lock,
+            sample_interval > 0 ? std::min(next_harvest, next_sample) : next_harvest);
+        if (_harvester_stop) {
+            break;
+        }
+        clock::time_point t = clock::now();
+        lock.unlock();
+        if (sample_interval > 0 && t >= next_sample) {
+            sample_counters();
+            // a slow harvest skips samples rather than bursting to catch up
+            next_sample += sample_period;
+            if (next_sample <= t) {
+                next_sample = t + sample_period;
+            }
+        }
+        if (t >= next_harvest) {
+            harvest();
+            next_harvest = clock::now() + harvest_period;
+        }
+        lock.lock();
+    }
+}
+
+void Tracer::add_counter_sampler(
+        const std::string& name,
+        const std::string& cat,
+        const std::string& series,
+        Counter_sampler sampler)
+{
+    String_id name_id = intern(name);
+    String_id cat_id = intern(cat);
+    String_id series_id = intern(series);
+    std::lock_guard<std::mutex> lock(_samplers_mutex);
+    for (auto& counter : _sampled_counters) {
+        if (counter.name == name_id && counter.cat == cat_id) {
+            if (counter.series.size() < MAX_EVENT_ARGS) {
+                counter.series.push_back(series_id);
+                counter.samplers.push_back(std::move(sampler));
+            }
+            return;
+        }
+    }
+    Sampled_counter counter;
+    counter.name = name_id;
+    counter.cat = cat_id;
+    counter.series.push_back(series_id);
+    counter.samplers.push_back(std::move(sampler));
+    _sampled_counters.push_back(std::move(counter));
+}
+
+void Tracer::add_counter_sampler(
+        const std::string& name,
+        const std::string& cat,
+        const std::string& series,
+        const std::atomic<int64_t>& value)
+{
+    const std::atomic<int64_t>* p = &value;
+    add_counter_sampler(name, cat, series, [p] { return p->load(std::memory_order_relaxed); });
+}
+
+void Tracer::remove_counter_samplers(const std::string& name, const std::string& cat) {
+    String_id name_id = intern(name);
+    String_id cat_id = intern(cat);
+    std::lock_guard<std::mutex> lock(_samplers_mutex);
+    _sampled_counters.erase(
+        std::remove_if(_sampled_counters.begin(), _sampled_counters.end(),
+            [name_id, cat_id](const Sampled_counter& counter) {
+                return counter.name == name_id && counter.cat == cat_id;
+            }),
+        _sampled_counters.end());
+}
+
+void Tracer::sample_counters() {
+    if (!is_enabled()) {
+        return;
+    }
+    // samples are stored as typed args like set_counter(): no text until export
+    std::lock_guard<std::mutex> lock(_samplers_mutex);
+    for (const auto& counter : _sampled_counters) {
+        if (!is_category_enabled(counter.cat)) {
+            continue;
+        }
+        _sample_args.clear();
+        for (size_t i = 0; i < counter.series.size(); ++i) {
+            _sample_args.push_back(make_arg(counter.series[i], counter.samplers[i]()));
+        }
+        push_event(counter.name, counter.cat, Phase::Counter, now(), 0,
+            _sample_args.data(), (uint32_t)(_sample_args.size()), nullptr);
+    }
+}
+
+void Tracer::advance_consumers() {
+    if (_harvester_running.load()) {
+        // the harvester thread does this work
+        return;
+    }
+    harvest();
+}
+
+void Tracer::harvest() {
+    // Note: harvests are serialized so the harvester thread and a call to
+    // shutdown() never interleave
+    // Note: calibrate before locking so a wait for it doesn't block
+    // remove_consumer() etc.
+    _clock.calibrate();
+    std::lock_guard<std::mutex> harvest_lock(_harvest_mutex);
+    std::chrono::steady_clock::time_point harvest_start = std::chrono::steady_clock::now();
+    if (_snapshot_state.load(std::memory_order_acquire) == SNAPSHOT_PENDING) {
+        take_snapshot(_snapshot_consumer, _snapshot_window);
+        _snapshot_state.store(SNAPSHOT_IDLE, std::memory_order_release);
+    }
+
+    // collect events from all thread buffers
+    std::shared_ptr<Harvest_data> data = get_harvest_data();
+    Harvest& harvest = data->harvest;
+    harvest_events(harvest);
+
+    // consumers are called without _consumer_mutex so a slow one never
+    // blocks add_consumer() (remove_consumer() waits for the harvest)
+    std::vector<Consumer*>& consumers = _harvest_consumers;
+    {
+        std::lock_guard<std::mutex> lock(_consumer_mutex);
+        consumers = _consumers; // Note: assignment reuses capacity
+    }
+    if (consumers.empty()) {
+        update_stats(harvest_start, harvest.events.size(), true, 0);
+        remove_exited_thread_records();
+        return;
+    }
+    if (has_sorted_export()) {
+        sort_events(harvest);
+    }
+
+    // convert events to strings once, but only if someone wants them: all
+    // consumers share the same batch
+    // Note: we carry on when there are no events (e.g. their categories are
+    // all disabled) so that consumers still expire
+    update_strings();
+    data->strings = _harvest_strings;
+    bool have_events = !harvest.events.empty();
+    bool need_json = false;
+    for (size_t i = 0; i < consumers.size(); ++i) {
+        if (consumers[i]->get_format() == Consumer::JSON) {
+            need_json = true;
+            break;
+        }
+    }
+    if (need_json) {
+        serialize_events(harvest, data->json, data->ends);
+    }
+    Batch batch = make_batch(data);
+    Raw_batch raw_batch = make_raw_batch(data);
+
+    // consume events, after any new thread metadata
+    send_thread_meta_events(consumers);
+    uint64_t now = get_now_msec();
+    std::vector<Tracer::Consumer*>& expired_consumers = _expired_consumers;
+    expired_consumers.clear();
+    for (Tracer::Consumer* consumer : consumers) {
+        if (!have_events) {
+            // nothing to consume
+        } else if (consumer->get_format() == Consumer::RAW) {
+            consumer->consume_raw(raw_batch);
+        } else {
+            consumer->consume_batch(batch);
+        }
+        consumer->check_expiry(now);
+        if (consumer->is_expired()) {
+            expired_consumers.push_back(consumer);
+        }
+    }
+    if (!expired_consumers.empty()) {
+        std::lock_guard<std::mutex> lock(_consumer_mutex);
+        for (Tracer::Consumer* consumer : expired_consumers) {
+            auto itr = std::find(_consumers.begin(), _consumers.end(), consumer);
+            if (itr != _consumers.end()) {
+                *itr = _consumers.back();
+                _consumers.pop_back();
+            }
+        }
+        update_enabled();
+    }
+    update_stats(harvest_start, harvest.events.size(), false, data->json.size());
+
+    // complete expired consumers with meta_events
+    if (expired_consumers.size() > 0) {
+        // copy meta_events under lock
+        std::vector<std::string> meta_events;
+        {
+            std::lock_guard<std::mutex> lock(_meta_mutex);
+            meta_events = _meta_events;
+        }
+        meta_events.push_back(get_stats_meta_event());
+        // feed meta_events to consumers (with any thread metadata they lack)
+        for (size_t i = 0; i < expired_consumers.size(); ++i) {
+            Tracer::Consumer* consumer = expired_consumers[i];
+            std::vector<std::string> consumer_meta_events = meta_events;
+            get_thread_meta_events(consumer->_thread_meta_version, consumer_meta_events);
+            consumer->finish(consumer_meta_events);
+        }
+    }
+    remove_exited_thread_records();
+}
+
+void Tracer::update_stats(
+        std::chrono::steady_clock::time_point harvest_start,
+        size_t num_events,
+        bool discarded,
+        size_t num_bytes)
+{
+    uint64_t nsec = (uint64_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - harvest_start).count());
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _stats.events_harvested += num_events;
+    if (discarded) {
+        _stats.events_discarded += num_events;
+    }
+    _stats.bytes_serialized += num_bytes;
+    ++_stats.harvests;
+    _stats.harvest_nsec += nsec;
+    _stats.max_harvest_nsec = std::max(_stats.max_harvest_nsec, nsec);
+}
+
+Tracer::Stats Tracer::get_stats() const {
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        stats = _stats;
+    }
+    stats.args_dropped = _args_dropped.load(std::memory_order_relaxed);
+    stats.chunks_allocated = _chunks_allocated.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::string Tracer::get_stats_meta_event() const {
+    Stats stats = get_stats();
+    std::string event = "{\"name\":\"teflib_stats\",\"ph\":\"M\",\"pid\":" + _pid_str + ",\"tid\":0,\"args\":{";
+    const std::pair<const char*, uint64_t> values[] = {
+        { "events_harvested", stats.events_harvested },
+        { "events_discarded", stats.events_discarded },
+        { "args_dropped", stats.args_dropped },
+        { "bytes_serialized", stats.bytes_serialized },
+        { "chunks_allocated", stats.chunks_allocated },
+        { "harvests", stats.harvests },
+        { "harvest_nsec", stats.harvest_nsec },
+        { "max_harvest_nsec", stats.max_harvest_nsec }
+    };
+    for (const auto& value : values) {
+        if (event.back() != '{') {
+            event.push_back(',');
+        }
+        event.push_back('"');
+        event.append(value.first);
+        event.append("\":");
+        append_uint(event, value.second);
+    }
+    event.append("}}");
+    return event;
+}
+
+// call this for clean shutdown of active consumers
+void Tracer::shutdown() {
+    stop_harvester();
+    {
+        std::lock_guard<std::mutex> lock(_consumer_mutex);
+        for (size_t i = 0; i < _consumers.size(); ++i) {
+            _consumers[i]->update_expiry(0);
+        }
+    }
+    harvest();
+}
+
+void Tracer::add_consumer(Tracer::Consumer* consumer) {
+    if (consumer) {
+        consumer->update_expiry(get_now_msec());
+        std::lock_guard<std::mutex> lock(_consumer_mutex);
+        _consumers.push_back(consumer);
+        update_enabled();
+    }
+}
+
+void Tracer::remove_consumer(Tracer::Consumer* consumer) {
+    // Note: no need to call this unless you're closing the consumer early
+    // (e.g. before is_complete)
+    // Note: harvests call consumers outside _consumer_mutex: wait for any
+    // in progress so the consumer can be deleted as soon as we return
+    std::lock_guard<std::mutex> harvest_lock(_harvest_mutex);
+    std::lock_guard<std::mutex> lock(_consumer_mutex);
+    size_t i = 0;
+    while (i < _consumers.size()) {
+        if (consumer == _consumers[i]) {
+            size_t last_index = _consumers.size() - 1;
+            if (i != last_index) {
+                _consumers[i] = _consumers[last_index];
+            } else {
+                ++i;
+            }
+            _consumers.pop_back();
+            continue;
+        }
+        ++i;
+    }
+    update_enabled();
+}
+
+Queued_consumer::Queued_consumer(Tracer::Consumer* consumer, size_t max_batches, Policy policy)
+    : Tracer::Consumer(consumer->get_lifetime(), consumer->get_format()),
+    _consumer(consumer),
+    _max_batches(std::max(max_batches, (size_t)1)),
+    _policy(policy)
+{
+    _categories = consumer->get_categories();
+    _thread = std::thread([this] { run(); });
+}
+
+Queued_consumer::~Queued_consumer() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _not_empty.notify_all();
+    _not_full.notify_all();
+    _thread.join();
+    // deleted before the Tracer finished us (e.g. removed early): finish the
+    // wrapped consumer anyway so it closes its output (a file's "]}")
+    if (_consumer->_state != State::COMPLETE) {
+        _consumer->_state = State::EXPIRED;
+        _consumer->finish(std::vector<std::string>());
+    }
+}
+
+void Queued_consumer::push(Item&& item, bool droppable, size_t num_events) {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (droppable && _queue.size() >= _max_batches) {
+            if (_policy == DROP) {
+                _num_dropped.fetch_add(num_events);
+                return;
+            }
+            _not_full.wait(lock, [this] { return _queue.size() < _max_batches || _stop; });
+        }
+        _queue.push_back(std::move(item));
+    }
+    _not_empty.notify_one();
+}
+
+void Queued_consumer::consume_batch(const Tracer::Batch& batch) {
+    // the batch (not its data) is queued: its owner keeps the data alive
+    Item item;
+    item.type = Item::BATCH;
+    item.batch = batch;
+    push(std::move(item), true, batch.num_events);
+}
+
+void Queued_consumer::consume_raw(const Tracer::Raw_batch& batch) {
+    Item item;
+    item.type = Item::RAW_BATCH;
+    item.raw_batch = batch;
+    push(std::move(item), true, batch.num_events);
+}
+
+void Queued_consumer::consume_meta_events(const std::vector<std::string>& meta_events) {
+    // metadata is never dropped
+    Item item;
+    item.type = Item::META_EVENTS;
+    item.meta_events = meta_events;
+    push(std::move(item), false, 0);
+}
+
+void Queued_consumer::finish(const std::vector<std::string>& meta_events) {
+    assert(_state == State::EXPIRED);
+    // we are COMPLETE once our thread has finished _consumer
+    Item item;
+    item.type = Item::FINISH;
+    item.meta_events = meta_events;
+    push(std::move(item), false, 0);
+}
+
+void Queued_consumer::run() {
+    for (;;) {
+        Item item;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _not_empty.wait(lock, [this] { return !_queue.empty() || _stop; });
+            if (_queue.empty()) {
+                // stopped: only once what was queued is consumed
+                return;
+            }
+            item = std::move(_queue.front());
+            _queue.pop_front();
+        }
+        _not_full.notify_one();
+        switch (item.type) {
+            case Item::BATCH:
+                _consumer->consume_batch(item.batch);
+                break;
+            case Item::RAW_BATCH:
+                _consumer->consume_raw(item.raw_batch);
+                break;
+            case Item::META_EVENTS:
+                _consumer->consume_meta_events(item.meta_events);
+                break;
+            case Item::FINISH:
+                _consumer->_state = State::EXPIRED;
+                _consumer->finish(item.meta_events);
+                // Note: last, since our owner may delete us once it sees this
+                _state = State::COMPLETE;
+                return;
+        }
+    }
+}
+
+Trace_to_file::Trace_to_file(uint64_t lifetime, const std::string& filename)
+    : Tracer::Consumer(lifetime), _file(filename)
+{
+    _stream.open(_file);
+    if (!_stream.is_open()) {
+        TEFLIB_TRACE_LOG("failed to open trace file='{}'\n", _file);
+        _file.clear();
+    } else {
+        TEFLIB_TRACE_LOG("opened trace='{}'\n", _file);
+        _stream << JSON_TRACE_HEADER;
+    }
+}
+
+void Trace_to_file::consume_batch(const Tracer::Batch& batch) {
+    if (_stream.is_open()) {
+        // batch is already in our format: one write for the lot
+        _stream.write(batch.data, batch.size);
+    }
+}
+
+void Trace_to_file::consume_events(const std::vector<std::string>& events) {
+    if (_stream.is_open()) {
+        for (const auto& event : events) {
+            _stream << event << ",\n";
+        }
+    }
+}
+
+namespace {
+    // TRICK: file consumers end with a bogus "complete" event sans ending comma
+    // (this simplifies consume_event() logic)
+    std::string end_of_trace_json() {
+        std::string tid_str = Tracer::thread_id_as_string();
+        const Tracer& tracer = Tracer::instance();
+        uint64_t ts = tracer.get_clock().to_usec(tracer.now());
+#ifdef NO_FMT
+        std::string bogus_event = "{\"name\":\"end_of_trace\",\"ph\":\"X\",\"pid\":";
+        std::ostringstream ss;
+        ss << tracer.get_pid_string() << ",\"tid\":" << tid_str << ",\"ts\":" << ts << ",\"dur\":" << 1000 << "}";
+        bogus_event.append(ss.str());
+#else
+        std::string bogus_event = fmt::format(
+            "{{\"name\":\"end_of_trace\",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{},\"dur\":1000}}",
+            tracer.get_pid_string(), tid_str, ts);
+#endif // NO_FMT
+        bogus_event.append("\n]\n}\n"); // close array instead of comma
+        return bogus_event;
+    }
+}
+
+void Trace_to_file::finish(const std::vector<std::string>& meta_events) {
+    assert(_state == State::EXPIRED);
+    consume_events(meta_events);
+    if (_stream.is_open()) {
+        _stream << end_of_trace_json();
+        _stream.close();
+        TEFLIB_TRACE_LOG("closed trace='{}'\n", _file);
+    }
+    _state = State::COMPLETE;
+}
+
+#ifdef TEF_USE_ZLIB
+Trace_to_gzip::Trace_to_gzip(uint64_t lifetime, const std::string& filename, int level)
+    : Tracer::Consumer(lifetime), _file(filename)
+{
+    // mode is "wb" plus the compression level digit
+    char mode[4] = { 'w', 'b', (char)('0' + std::min(std::max(level, 1), 9)), 0 };
+    _stream = gzopen(_file.c_str(), mode);
+    if (!_stream) {
+        TEFLIB_TRACE_LOG("failed to open trace file='{}'\n", _file);
+        _file.clear();
+    } else {
+        TEFLIB_TRACE_LOG("opened trace='{}'\n", _file);
+        gzbuffer(_stream, 1 << 18);
+        write(JSON_TRACE_HEADER, sizeof(JSON_TRACE_HEADER) - 1);
+    }
+}
+
+Trace_to_gzip::~Trace_to_gzip() {
+    if (_stream) {
+        gzclose(_stream);
+    }
+}
+
+void Trace_to_gzip::write(const char* data, size_t size) {
+    // gzwrite() takes an unsigned length so feed huge blocks in pieces
+    constexpr size_t MAX_WRITE = 1 << 30;
+    while (size > 0 && _stream) {
+        unsigned int n = (unsigned int)(std::min(size, MAX_WRITE));
+        if (gzwrite(_stream, data, n) != (int)n) {
+            TEFLIB_TRACE_LOG("failed to write trace file='{}'\n", _file);
+            gzclose(_stream);
+            _stream = nullptr;
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+void Trace_to_gzip::consume_batch(const Tracer::Batch& batch) {
+    // compressed incrementally: zlib only holds its window and our gzbuffer
+    write(batch.data, batch.size);
+}
+
+void Trace_to_gzip::consume_events(const std::vector<std::string>& events) {
+    for (const auto& event : events) {
+        write(event.data(), event.size());
+        write(",\n", 2);
+    }
+}
+
+void Trace_to_gzip::finish(const std::vector<std::string>& meta_events) {
+    assert(_state == State::EXPIRED);
+    consume_events(meta_events);
+    if (_stream) {
+        std::string trailer = end_of_trace_json();
+        write(trailer.data(), trailer.size());
+    }
+    if (_stream) {
+        gzclose(_stream);
+        _stream = nullptr;
+        TEFLIB_TRACE_LOG("closed trace='{}'\n", _file);
+    }
+    _state = State::COMPLETE;
+}
+#endif // TEF_USE_ZLIB
+
+#ifndef _WIN32
+Trace_to_mmap::Trace_to_mmap(uint64_t lifetime, const std::string& filename, size_t extent_size)
+    : Tracer::Consumer(lifetime), _file(filename)
+{
+    // extents are whole pages
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    _extent_size = std::max((extent_size + page_size - 1) / page_size * page_size, page_size);
+    _fd = ::open(_file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd == -1) {
+        TEFLIB_TRACE_LOG("failed to open trace file='{}'\n", _file);
+        _file.clear();
+    } else {
+        TEFLIB_TRACE_LOG("opened trace='{}'\n", _file);
+        write(JSON_TRACE_HEADER, sizeof(JSON_TRACE_HEADER) - 1);
+    }
+}
+
+Trace_to_mmap::~Trace_to_mmap() {
+    // unfinished: leave what we have for recover_json_trace()
+    close();
+}
+
+bool Trace_to_mmap::reserve(size_t size) {
+    if (_size + size <= _mapped) {
+        return true;
+    }
+    size_t mapped = (_size + size + _extent_size - 1) / _extent_size * _extent_size;
+    // allocate the blocks up front so page faults never hit a full disk
+    // (which would be SIGBUS rather than an error)
+#ifdef __APPLE__
+    bool grown = ftruncate(_fd, (off_t)mapped) == 0;
+#else
+    bool grown = posix_fallocate(_fd, (off_t)_mapped, (off_t)(mapped - _mapped)) == 0;
+#endif // __APPLE__
+    void* map = MAP_FAILED;
+    if (grown) {
+#ifdef __linux__
+        map = _map ? mremap(_map, _mapped, mapped, MREMAP_MAYMOVE)
+            : mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+#else
+        if (_map) {
+            munmap(_map, _mapped);
+            _map = nullptr;
+        }
+        map = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+#endif // __linux__
+    }
+    if (map == MAP_FAILED) {
+        TEFLIB_TRACE_LOG("failed to grow trace file='{}'\n", _file);
+        close();
+        return false;
+    }
+    _map = (char*)map;
+    _mapped = mapped;
+    return true;
+}
+
+void Trace_to_mmap::write(const char* data, size_t size) {
+    if (_fd != -1 && reserve(size)) {
+        memcpy(_map + _size, data, size);
+        _size += size;
+    }
+}
+
+void Trace_to_mmap::close() {
+    if (_fd == -1) {
+        return;
+    }
+    if (_map) {
+        munmap(_map, _mapped);
+        _map = nullptr;
+    }
+    // drop the unused part of the last extent
+    if (ftruncate(_fd, (off_t)_size) != 0) {
+        TEFLIB_TRACE_LOG("failed to truncate trace file='{}'\n", _file);
+    }
+    ::close(_fd);
+    _fd = -1;
+    _mapped = 0;
+}
+
+void Trace_to_mmap::consume_batch(const Tracer::Batch& batch) {
+    // one copy into the page cache: no syscall unless an extent is added
+    write(batch.data, batch.size);
+}
+
+void Trace_to_mmap::consume_events(const std::vector<std::string>& events) {
+    for (const auto& event : events) {
+        if (reserve(event.size() + 2)) {
+            write(event.data(), event.size());
+            write(",\n", 2);
+        }
+    }
+}
+
+void Trace_to_mmap::finish(const std::vector<std::string>& meta_events) {
+    assert(_state == State::EXPIRED);
+    consume_events(meta_events);
+    if (_fd != -1) {
+        std::string trailer = end_of_trace_json();
+        write(trailer.data(), trailer.size());
+    }
+    if (_fd != -1) {
+        close();
+        TEFLIB_TRACE_LOG("closed trace='{}'\n", _file);
+    }
+    _state = State::COMPLETE;
+}
+#endif // _WIN32
+
+// Binary trace format
+//
+// All integers are LEB128 varints unless noted otherwise and signed values
+// are zigzag encoded.  A file is a header followed by records:
+//
+//   header = "TEFB" version:u8 ts_units_per_second (USEC or NSEC_PER_SECOND)
+//            pid origin_nsec    (version 2: steady_clock nsec at ts 0)
+//
+//   record = type:u8 payload
+//     STRING: id length bytes          (ids arrive in order 0, 1, 2...)
+//     EVENTS: tid count event*         (one run of events from one thread)
+//     META:   length bytes             (one TEF JSON meta event)
+//     END:                             (trace is complete)
+//
+//   event = ph:u8 ts_delta:signed dur name cat num_args arg*
+//     ts_delta is relative to the previous event of the same thread
+//
+//   arg = type:u8 key value
+//     INT:signed UINT:varint DOUBLE:8 bytes little endian BOOL:u8
+//     STRING:id JSON:length bytes
+//
+namespace {
+    const char BINARY_MAGIC[] = "TEFB";
+    constexpr uint8_t BINARY_VERSION = 2;
+
+    enum Binary_record : uint8_t {
+        STRING_RECORD = 1,
+        EVENTS_RECORD = 2,
+        META_RECORD = 3,
+        END_RECORD = 4
+    };
+
+    void append_varint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((char)((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char)value);
+    }
+
+    void append_signed_varint(std::string& out, int64_t value) {
+        append_varint(out, ((uint64_t)(value) << 1) ^ (uint64_t)(value >> 63));
+    }
+
+    void append_bytes(std::string& out, const char* data, size_t size) {
+        append_varint(out, size);
+        out.append(data, size);
+    }
+
+    // Binary_reader pulls values out of a streambuf and latches any error
+    class Binary_reader {
+    public:
+        Binary_reader(std::streambuf& in) : _in(in) { }
+
+        bool ok() const { return _ok; }
+
+        uint8_t read_u8() {
+            int c = _in.sbumpc();
+            if (c == std::char_traits<char>::eof()) {
+                _ok = false;
+                return 0;
+            }
+            return (uint8_t)c;
+        }
+
+        uint64_t read_varint() {
+            uint64_t value = 0;
+            for (uint32_t shift = 0; shift < 64 && _ok; shift += 7) {
+                uint8_t byte = read_u8();
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    return value;
+                }
+            }
+            _ok = false;
+            return 0;
+        }
+
+        int64_t read_signed_varint() {
+            uint64_t value = read_varint();
+            return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        }
+
+        void read_bytes(std::string& out) {
+            uint64_t size = read_varint();
+            out.resize(_ok ? size : 0);
+            if (size > 0 && _ok) {
+                _ok = (uint64_t)(_in.sgetn(&out[0], size)) == size;
+            }
+        }
+
+        double read_double() {
+            uint64_t bits = 0;
+            for (uint32_t i = 0; i < 8; ++i) {
+                bits |= (uint64_t)(read_u8()) << (8 * i);
+            }
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+    private:
+        std::streambuf& _in;
+        bool _ok { true };
+    };
+}
+
+namespace {
+    // Binary_decoder turns a binary trace stream back into TEF JSON a
+    // record at a time.  Its state only changes once a record has been read
+    // whole, so a record which was cut short can be decoded again when the
+    // rest of it arrives.  Timestamps are moved onto the timeline whose
+    // ts 0 is steady_clock time timeline_nsec (by default the stream's own).
+    class Binary_decoder {
+    public:
+        enum Result { RECORD, END, INCOMPLETE, INVALID };
+
+        Result decode_header(Binary_reader& reader);
+        // out += the record's events, each preceded by ",\n" unless first
+        Result decode_record(Binary_reader& reader, std::string& out, bool& first);
+        // out += clock_sync event (version 2 streams)
+        void append_clock_sync(std::string& out, bool& first) const;
+        void set_timeline_nsec(uint64_t timeline_nsec);
+
+    private:
+        uint8_t _version { 0 };
+        uint64_t _units_per_second { USEC_PER_SECOND };
+        std::string _pid { "1" };
+        uint64_t _origin_nsec { 0 };
+        uint64_t _timeline_nsec { 0 };
+        int64_t _ts_offset { 0 }; // in units, from our ts 0 to the timeline's
+        std::vector<std::string> _strings; // JSON-escaped
+        std::unordered_map<String_id, uint64_t> _last_ts;
+        std::vector<Tracer::Event> _events;
+        std::vector<Arg> _args;
+        std::string _text;
+        std::string _bytes;
+    };
+
+    Binary_decoder::Result Binary_decoder::decode_header(Binary_reader& reader) {
+        char magic[4] = { 0, 0, 0, 0 };
+        for (uint32_t i = 0; i < 4; ++i) {
+            magic[i] = (char)reader.read_u8();
+        }
+        uint8_t version = reader.read_u8();
+        uint64_t units_per_second = reader.read_varint();
+        uint64_t pid = 1;
+        uint64_t origin_nsec = 0;
+        if (version >= 2) {
+            pid = reader.read_varint();
+            origin_nsec = reader.read_varint();
+        }
+        if (!reader.ok()) {
+            return INCOMPLETE;
+        }
+        if (memcmp(magic, BINARY_MAGIC, 4) != 0 || version < 1 || version > BINARY_VERSION
+                || (units_per_second != USEC_PER_SECOND && units_per_second != NSEC_PER_SECOND)) {
+            return INVALID;
+        }
+        _version = version;
+        _units_per_second = units_per_second;
+        _pid = std::to_string(pid);
+        _origin_nsec = origin_nsec;
+        set_timeline_nsec(origin_nsec);
+        return RECORD;
+    }
+
+    void Binary_decoder::set_timeline_nsec(uint64_t timeline_nsec) {
+        _timeline_nsec = timeline_nsec;
+        int64_t offset_nsec = (int64_t)(_origin_nsec - timeline_nsec);
+        _ts_offset = offset_nsec / (int64_t)(NSEC_PER_SECOND / _units_per_second);
+    }
+
+    void Binary_decoder::append_clock_sync(std::string& out, bool& first) const {
+        if (_version < 2) {
+            return;
+        }
+        if (!first) {
+            out.append(",\n");
+        }
+        first = false;
+        // at our ts 0, or the timeline's if that is later
+        if (_ts_offset > 0) {
+            append_clock_sync_json(out, _pid, (uint64_t)(_ts_offset), _units_per_second, _origin_nsec);
+        } else {
+            append_clock_sync_json(out, _pid, 0, _units_per_second, _timeline_nsec);
+        }
+    }
+
+    Binary_decoder::Result Binary_decoder::decode_record(Binary_reader& reader, std::string& out, bool& first) {
+        uint8_t type = reader.read_u8();
+        if (!reader.ok()) {
+            return INCOMPLETE;
+        }
+        switch (type) {
+            case STRING_RECORD: {
+                uint64_t id = reader.read_varint();
+                reader.read_bytes(_bytes);
+                if (!reader.ok()) {
+                    return INCOMPLETE;
+                }
+                if (id != _strings.size()) {
+                    return INVALID;
+                }
+                _strings.push_back(std::string());
+                append_escaped(_strings.back(), _bytes);
+                return RECORD;
+            }
+            case EVENTS_RECORD: {
+                String_id tid = (String_id)(reader.read_varint());
+                uint64_t count = reader.read_varint();
+                auto itr = _last_ts.find(tid);
+                uint64_t ts = itr != _last_ts.end() ? itr->second : 0;
+                _events.clear();
+                _args.clear();
+                _text.clear();
+                for (uint64_t i = 0; i < count && reader.ok(); ++i) {
+                    Tracer::Event event;
+                    event.depth = 0;
+                    event.ph = (Phase)(reader.read_u8());
+                    ts += (uint64_t)(reader.read_signed_varint());
+                    event.ts = ts;
+                    event.dur = reader.read_varint();
+                    event.name = (String_id)(reader.read_varint());
+                    event.cat = (String_id)(reader.read_varint());
+                    event.num_args = (uint8_t)(reader.read_varint());
+                    event.args_begin = (uint32_t)(_args.size());
+                    for (uint32_t k = 0; k < event.num_args && reader.ok(); ++k) {
+                        Arg arg;
+                        arg.type = (Arg::Type)(reader.read_u8());
+                        arg.key = (String_id)(reader.read_varint());
+                        switch (arg.type) {
+                            case Arg::INT:
+                                arg.value.i = reader.read_signed_varint();
+                                break;
+                            case Arg::UINT:
+                                arg.value.u = reader.read_varint();
+                                break;
+                            case Arg::DOUBLE:
+                                arg.value.d = reader.read_double();
+                                break;
+                            case Arg::BOOL:
+                                arg.value.b = reader.read_u8() != 0;
+                                break;
+                            case Arg::STRING:
+                                arg.value.str = (String_id)(reader.read_varint());
+                                break;
+                            case Arg::JSON:
+                                reader.read_bytes(_bytes);
+                                arg.value.text.offset = (uint32_t)(_text.size());
+                                arg.value.text.size = (uint32_t)(_bytes.size());
+                                _text.append(_bytes);
+                                break;
+                            default:
+                                return reader.ok() ? INVALID : INCOMPLETE;
+                        }
+                        if (reader.ok() && (arg.key >= _strings.size()
+                                || (arg.type == Arg::STRING && arg.value.str >= _strings.size()))) {
+                            return INVALID;
+                        }
+                        _args.push_back(arg);
+                    }
+                    if (reader.ok() && (event.name >= _strings.size() || event.cat >= _strings.size())) {
+                        return INVALID;
+                    }
+                    _events.push_back(event);
+                }
+                if (!reader.ok()) {
+                    return INCOMPLETE;
+                }
+                if (tid >= _strings.size()) {
+                    return INVALID;
+                }
+                _last_ts[tid] = ts;
+                for (size_t i = 0; i < _events.size(); ++i) {
+                    if (!first) {
+                        out.append(",\n");
+                    }
+                    first = false;
+                    Tracer::Event& event = _events[i];
+                    int64_t event_ts = (int64_t)(event.ts) + _ts_offset;
+                    event.ts = event_ts > 0 ? (uint64_t)(event_ts) : 0;
+                    append_event_json(out, event, _pid, _strings[tid], _args.data(), _text.data(), _strings.data(),
+                            _units_per_second);
+                }
+                return RECORD;
+            }
+            case META_RECORD:
+                reader.read_bytes(_bytes);
+                if (!reader.ok()) {
+                    return INCOMPLETE;
+                }
+                if (!first) {
+                    out.append(",\n");
+                }
+                first = false;
+                out.append(_bytes);
+                return RECORD;
+            case END_RECORD:
+                return END;
+            default:
+                return INVALID;
+        }
+    }
+}
+
+Binary_encoder::Binary_encoder(uint64_t ts_units_per_second) : _ts_units_per_second(ts_units_per_second) {
+}
+
+void Binary_encoder::append_header(std::string& out) const {
+    const Tracer& tracer = Tracer::instance();
+    out.append(BINARY_MAGIC, 4);
+    out.push_back((char)BINARY_VERSION);
+    append_varint(out, _ts_units_per_second);
+    append_varint(out, tracer.get_pid());
+    append_varint(out, tracer.get_clock().get_origin_nsec());
+}
+
+void Binary_encoder::append_strings(const Tracer::Raw_batch& batch, std::string& out) {
+    // strings interned since our last batch
+    for (size_t i = _num_strings; i < batch.num_strings; ++i) {
+        out.push_back((char)STRING_RECORD);
+        append_varint(out, i);
+        append_bytes(out, batch.strings[i].data(), batch.strings[i].size());
+    }
+    _num_strings = std::max(_num_strings, batch.num_strings);
+}
+
+void Binary_encoder::append_events(const Tracer::Raw_batch& batch, std::string& out) {
+    // in case precision was changed after we wrote our header
+    uint64_t scale_up = 1;
+    uint64_t scale_down = 1;
+    if (batch.ts_units_per_second > _ts_units_per_second) {
+        scale_down = batch.ts_units_per_second / _ts_units_per_second;
+    } else {
+        scale_up = _ts_units_per_second / batch.ts_units_per_second;
+    }
+
+    size_t begin = 0;
+    for (size_t i = 0; i < batch.num_ranges; ++i) {
+        const Tracer::Thread_range& range = batch.ranges[i];
+        out.push_back((char)EVENTS_RECORD);
+        append_varint(out, range.tid);
+        append_varint(out, range.end - begin);
+        uint64_t& last_ts = _last_ts[range.tid];
+        for (size_t j = begin; j < range.end; ++j) {
+            const Tracer::Event& event = batch.events[j];
+            out.push_back(event.ph);
+            uint64_t ts = event.ts * scale_up / scale_down;
+            append_signed_varint(out, (int64_t)(ts - last_ts));
+            last_ts = ts;
+            // Note: has_id() events keep their id in dur's place
+            append_varint(out, has_id(event.ph) ? event.id : event.dur * scale_up / scale_down);
+            append_varint(out, event.name);
+            append_varint(out, event.cat);
+            append_varint(out, event.num_args);
+            for (uint32_t k = 0; k < event.num_args; ++k) {
+                const Arg& arg = batch.args[event.args_begin + k];
+                out.push_back((char)arg.type);
+                append_varint(out, arg.key);
+                switch (arg.type) {
+                    case Arg::INT:
+                        append_signed_varint(out, arg.value.i);
+                        break;
+                    case Arg::UINT:
+                        append_varint(out, arg.value.u);
+                        break;
+                    case Arg::DOUBLE: {
+                        uint64_t bits;
+                        memcpy(&bits, &arg.value.d, sizeof(bits));
+                        for (uint32_t n = 0; n < 8; ++n) {
+                            out.push_back((char)(bits >> (8 * n)));
+                        }
+                        break;
+                    }
+                    case Arg::BOOL:
+                        out.push_back(arg.value.b ? 1 : 0);
+                        break;
+                    case Arg::STRING:
+                        append_varint(out, arg.value.str);
+                        break;
+                    case Arg::JSON:
+                        append_bytes(out, batch.text + arg.value.text.offset, arg.value.text.size);
+                        break;
+                }
+            }
+        }
+        begin = range.end;
+    }
+}
+
+void Binary_encoder::append_meta_events(const std::vector<std::string>& meta_events, std::string& out) const {
+    // the header carries the clock sync
+    const std::string& clock_sync = Tracer::instance().get_clock_sync_event();
+    for (size_t i = 0; i < meta_events.size(); ++i) {
+        if (meta_events[i] == clock_sync) {
+            continue;
+        }
+        out.push_back((char)META_RECORD);
+        append_bytes(out, meta_events[i].data(), meta_events[i].size());
+    }
+}
+
+void Binary_encoder::append_end(std::string& out) const {
+    out.push_back((char)END_RECORD);
+}
+
+Trace_to_binary::Trace_to_binary(uint64_t lifetime, const std::string& filename)
+    : Tracer::Consumer(lifetime, Tracer::Consumer::RAW), _file(filename),
+    _encoder(Tracer::instance().has_nanosecond_precision() ? NSEC_PER_SECOND : USEC_PER_SECOND)
+{
+    _stream.open(_file, std::ios::binary);
+    if (!_stream.is_open()) {
+        TEFLIB_TRACE_LOG("failed to open trace file='{}'\n", _file);
+        _file.clear();
+    } else {
+        TEFLIB_TRACE_LOG("opened trace='{}'\n", _file);
+        _encoder.append_header(_buffer);
+        _stream.write(_buffer.data(), _buffer.size());
+    }
+}
+
+void Trace_to_binary::consume_raw(const Tracer::Raw_batch& batch) {
+    if (_stream.is_open()) {
+        _buffer.clear();
+        _encoder.append_strings(batch, _buffer);
+        _encoder.append_events(batch, _buffer);
+        _stream.write(_buffer.data(), _buffer.size());
+    }
+}
+
+void Trace_to_binary::consume_meta_events(const std::vector<std::string>& meta_events) {
+    if (_stream.is_open()) {
+        _buffer.clear();
+        _encoder.append_meta_events(meta_events, _buffer);
+        _stream.write(_buffer.data(), _buffer.size());
+    }
+}
+
+void Trace_to_binary::finish(const std::vector<std::string>& meta_events) {
+    assert(_state == State::EXPIRED);
+    if (_stream.is_open()) {
+        _buffer.clear();
+        _encoder.append_meta_events(meta_events, _buffer);
+        _encoder.append_end(_buffer);
+        _stream.write(_buffer.data(), _buffer.size());
+        _stream.close();
+        TEFLIB_TRACE_LOG("closed trace='{}'\n", _file);
+    }
+    _state = State::COMPLETE;
+}
+
+#ifndef _WIN32
+namespace {
+#ifdef MSG_NOSIGNAL
+    constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    constexpr int SEND_FLAGS = 0; // SO_NOSIGPIPE instead
+#endif // MSG_NOSIGNAL
+
+    int open_nonblocking_socket(int family) {
+        int fd = socket(family, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif // SO_NOSIGPIPE
+        return fd;
+    }
+}
+
+Trace_to_socket::Trace_to_socket(uint64_t lifetime, const std::string& address, Format format,
+        size_t max_buffered, uint64_t finish_timeout)
+    : Tracer::Consumer(lifetime, format), _address(address),
+    _encoder(Tracer::instance().has_nanosecond_precision() ? NSEC_PER_SECOND : USEC_PER_SECOND),
+    _max_buffered(max_buffered), _finish_timeout(finish_timeout)
+{
+    if (!connect()) {
+        TEFLIB_TRACE_LOG("failed to connect to trace collector='{}'\n", _address);
+        return;
+    }
+    TEFLIB_TRACE_LOG("streaming trace to='{}'\n", _address);
+    std::string header;
+    if (_format == RAW) {
+        _encoder.append_header(header);
+    } else {
+        header = JSON_TRACE_HEADER;
+    }
+    push(std::move(header));
+    flush(0);
+}
+
+Trace_to_socket::~Trace_to_socket() {
+    close();
+}
+
+bool Trace_to_socket::connect() {
+    // the connection completes in the background: see flush()
+    int result = -1;
+    if (_address.compare(0, 5, "unix:") == 0) {
+        std::string path = _address.substr(5);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.data(), path.size());
+        _fd = open_nonblocking_socket(AF_UNIX);
+        if (_fd != -1) {
+            result = ::connect(_fd, (const struct sockaddr*)&addr, sizeof(addr));
+        }
+    } else {
+        size_t colon = _address.rfind(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        std::string host = _address.substr(0, colon);
+        std::string port = _address.substr(colon + 1);
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2); // [::1]:port
+        }
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        struct addrinfo* info = nullptr;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info) != 0) {
+            return false;
+        }
+        _fd = open_nonblocking_socket(info->ai_family);
+        if (_fd != -1) {
+            result = ::connect(_fd, info->ai_addr, info->ai_addrlen);
+        }
+        freeaddrinfo(info);
+    }
+    if (_fd == -1) {
+        return false;
+    }
+    if (result == -1 && errno != EINPROGRESS) {
+        close();
+        return false;
+    }
+    _connecting = result == -1;
+    return true;
+}
+
+void Trace_to_socket::push(Chunk&& chunk) {
+    _queued_bytes += chunk.size;
+    _queue.push_back(std::move(chunk));
+}
+
+void Trace_to_socket::push(std::string&& bytes) {
+    if (!bytes.empty()) {
+        Chunk chunk;
+        chunk.size = bytes.size();
+        chunk.bytes = std::move(bytes);
+        push(std::move(chunk));
+    }
+}
+
+bool Trace_to_socket::flush(int timeout_msec) {
+    // send what the socket takes, waiting at most timeout_msec for it
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_msec);
+    while (_fd != -1 && (_connecting || !_queue.empty())) {
+        int wait = 0;
+        if (timeout_msec > 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            wait = (int)std::max<int64_t>(left, 0);
+        }
+        if (_connecting) {
+            struct pollfd pfd = { _fd, POLLOUT, 0 };
+            int ready = poll(&pfd, 1, wait);
+            if (ready == 0) {
+                return true;
+            }
+            if (ready == -1 && errno == EINTR) {
+                continue;
+            }
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (ready == -1 || getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+                TEFLIB_TRACE_LOG("failed to connect to trace collector='{}'\n", _address);
+                close();
+                return false;
+            }
+            _connecting = false;
+            continue;
+        }
+        const Chunk& chunk = _queue.front();
+        ssize_t sent = ::send(_fd, chunk.begin() + _offset, chunk.size - _offset, SEND_FLAGS);
+        if (sent > 0) {
+            _offset += (size_t)sent;
+            _queued_bytes -= (size_t)sent;
+            if (_offset == chunk.size) {
+                _queue.pop_front(); // releases the batch
+                _offset = 0;
+            }
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (wait == 0) {
+                return true;
+            }
+            struct pollfd pfd = { _fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, wait) == 0) {
+                return true;
+            }
+        } else if (errno != EINTR) {
+            TEFLIB_TRACE_LOG("lost connection to trace collector='{}'\n", _address);
+            close();
+            return false;
+        }
+    }
+    return _fd != -1;
+}
+
+void Trace_to_socket::close() {
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _connecting = false;
+    _queue.clear();
+    _offset = 0;
+    _queued_bytes = 0;
+}
+
+void Trace_to_socket::consume_batch(const Tracer::Batch& batch) {
+    if (_fd == -1) {
+        return;
+    }
+    if (!has_room()) {
+        _num_dropped += batch.num_events;
+    } else if (batch.owner) {
+        // zero-copy: the chunk keeps the harvest alive until it is sent
+        Chunk chunk;
+        chunk.owner = batch.owner;
+        chunk.data = batch.data;
+        chunk.size = batch.size;
+        push(std::move(chunk));
+    } else {
+        push(std::string(batch.data, batch.size));
+    }
+    flush(0);
+}
+
+void Trace_to_socket::consume_events(const std::vector<std::string>& events) {
+    if (_fd == -1) {
+        return;
+    }
+    std::string bytes;
+    for (const auto& event : events) {
+        bytes.append(event);
+        bytes.append(",\n");
+    }
+    push(std::move(bytes));
+    flush(0);
+}
+
+void Trace_to_socket::consume_raw(const Tracer::Raw_batch& batch) {
+    if (_fd == -1) {
+        return;
+    }
+    // later events may refer to the batch's strings so only its events are dropped
+    std::string bytes;
+    _encoder.append_strings(batch, bytes);
+    if (has_room()) {
+        _encoder.append_events(batch, bytes);
+    } else {
+        _num_dropped += batch.num_events;
+    }
+    push(std::move(bytes));
+    flush(0);
+}
+
+void Trace_to_socket::consume_meta_events(const std::vector<std::string>& meta_events) {
+    if (_format != RAW) {
+        consume_events(meta_events);
+    } else if (_fd != -1) {
+        std::string bytes;
+        _encoder.append_meta_events(meta_events, bytes);
+        push(std::move(bytes));
+        flush(0);
+    }
+}
+
+void Trace_to_socket::finish(const std::vector<std::string>& meta_events) {
+    assert(_state == State::EXPIRED);
+    if (_fd != -1) {
+        std::string bytes;
+        if (_format == RAW) {
+            _encoder.append_meta_events(meta_events, bytes);
+            _encoder.append_end(bytes);
+        } else {
+            for (const auto& event : meta_events) {
+                bytes.append(event);
+                bytes.append(",\n");
+            }
+            bytes.append(end_of_trace_json());
+        }
+        push(std::move(bytes));
+        if (flush((int)_finish_timeout) && !_queue.empty()) {
+            TEFLIB_TRACE_LOG("timed out sending trace to='{}'\n", _address);
+        }
+        close();
+        TEFLIB_TRACE_LOG("closed trace stream to='{}'\n", _address);
+    }
+    _state = State::COMPLETE;
+}
+
+// Shared memory trace segment
+//
+// The collector creates the segment and each writing process maps it and
+// claims a slot for itself:
+//
+//   segment = Trace_segment Trace_segment_slot*num_slots
+//   slot    = state pid write_pos read_pos ring (slot_size bytes)
+//
+// Each ring carries one binary trace stream with one writer, which only
+// moves write_pos, and one reader (the collector), which only moves
+// read_pos.  A slot goes FREE -> CLAIMED (by a writer) -> ACTIVE (pid is
+// set) -> DONE (write_pos is final) and back to FREE once the collector has
+// read all of it, or when its writer has died.
+namespace tef {
+    struct Trace_segment {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_slots;
+        uint64_t slot_size;
+        std::atomic<uint32_t> closed; // the collector has finished
+    };
+
+    struct Trace_segment_slot {
+        std::atomic<uint32_t> state;
+        std::atomic<uint32_t> pid;
+        std::atomic<uint64_t> write_pos;
+        std::atomic<uint64_t> read_pos;
+    };
+}
+
+namespace {
+    static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+        "atomics shared between processes must be lock free");
+
+    const char SEGMENT_MAGIC[8] = { 'T', 'E', 'F', 'S', 'H', 'M', 0, 0 };
+    constexpr uint32_t SEGMENT_VERSION = 1;
+
+    enum Slot_state : uint32_t {
+        SLOT_FREE = 0,
+        SLOT_CLAIMED = 1,
+        SLOT_ACTIVE = 2,
+        SLOT_DONE = 3
+    };
+
+    // each part of the segment starts on its own cache line
+    size_t align_to_line(size_t size) {
+        return (size + 63) & ~(size_t)(63);
+    }
+
+    size_t get_segment_size(uint32_t num_slots, uint64_t slot_size) {
+        return align_to_line(sizeof(Trace_segment))
+            + num_slots * (align_to_line(sizeof(Trace_segment_slot)) + align_to_line(slot_size));
+    }
+
+    Trace_segment_slot* get_slot(Trace_segment* segment, uint32_t index) {
+        char* base = (char*)(segment) + align_to_line(sizeof(Trace_segment));
+        size_t stride = align_to_line(sizeof(Trace_segment_slot)) + align_to_line(segment->slot_size);
+        return (Trace_segment_slot*)(base + index * stride);
+    }
+
+    char* get_ring(Trace_segment_slot* slot) {
+        return (char*)(slot) + align_to_line(sizeof(Trace_segment_slot));
+    }
+
+    // shm_open() names start with a slash
+    std::string get_segment_path(const std::string& name) {
+        return (!name.empty() && name[0] == '/') ? name : "/" + name;
+    }
+
+    // Memory_buffer reads bytes in place through a streambuf
+    class Memory_buffer : public std::streambuf {
+    public:
+        Memory_buffer(const char* data, size_t size) {
+            char* begin = const_cast<char*>(data);
+            setg(begin, begin, begin + size);
+        }
+        size_t get_offset() const { return (size_t)(gptr() - eback()); }
+    };
+}
+
+Trace_to_shared_memory::Trace_to_shared_memory(uint64_t lifetime, const std::string& name,
+        size_t max_buffered, uint64_t finish_timeout)
+    : Tracer::Consumer(lifetime, Tracer::Consumer::RAW), _name(name),
+    _encoder(Tracer::instance().has_nanosecond_precision() ? NSEC_PER_SECOND : USEC_PER_SECOND),
+    _max_buffered(max_buffered), _finish_timeout(finish_timeout)
+{
+    int fd = shm_open(get_segment_path(_name).c_str(), O_RDWR, 0);
+    if (fd == -1) {
+        TEFLIB_TRACE_LOG("failed to open trace segment='{}'\n", _name);
+        return;
+    }
+    struct stat info;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)(info.st_size) >= sizeof(Trace_segment)) {
+        map = mmap(nullptr, (size_t)(info.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        TEFLIB_TRACE_LOG("failed to map trace segment='{}'\n", _name);
+        return;
+    }
+    _segment = (Trace_segment*)(map);
+    _segment_size = (size_t)(info.st_size);
+    if (memcmp(_segment->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0 || _segment->version != SEGMENT_VERSION
+            || _segment_size < get_segment_size(_segment->num_slots, _segment->slot_size)
+            || _segment->closed.load(std::memory_order_acquire)) {
+        TEFLIB_TRACE_LOG("not a trace segment='{}'\n", _name);
+        close();
+        return;
+    }
+    for (uint32_t i = 0; i < _segment->num_slots; ++i) {
+        Trace_segment_slot* slot = get_slot(_segment, i);
+        uint32_t state = SLOT_FREE;
+        if (slot->state.compare_exchange_strong(state, SLOT_CLAIMED, std::memory_order_acq_rel)) {
+            slot->pid.store(get_process_id(), std::memory_order_relaxed);
+            slot->state.store(SLOT_ACTIVE, std::memory_order_release);
+            _slot = slot;
+            _ring = get_ring(slot);
+            _ring_size = _segment->slot_size;
+            break;
+        }
+    }
+    if (!_slot) {
+        TEFLIB_TRACE_LOG("no free slot in trace segment='{}'\n", _name);
+        close();
+        return;
+    }
+    TEFLIB_TRACE_LOG("streaming trace to segment='{}'\n", _name);
+    _encoder.append_header(_pending);
+    flush(0);
+}
+
+Trace_to_shared_memory::~Trace_to_shared_memory() {
+    close();
+}
+
+bool Trace_to_shared_memory::flush(uint64_t timeout_msec) {
+    // copy what fits into the ring, waiting at most timeout_msec for room
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_msec);
+    while (_slot && _offset < _pending.size()) {
+        if (_segment->closed.load(std::memory_order_acquire)) {
+            TEFLIB_TRACE_LOG("trace collector closed segment='{}'\n", _name);
+            close();
+            return false;
+        }
+        uint64_t write_pos = _slot->write_pos.load(std::memory_order_relaxed);
+        uint64_t read_pos = _slot->read_pos.load(std::memory_order_acquire);
+        uint64_t room = _ring_size - (write_pos - read_pos);
+        if (room == 0) {
+            if (timeout_msec == 0 || std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        size_t size = (size_t)(std::min<uint64_t>(room, _pending.size() - _offset));
+        size_t index = (size_t)(write_pos % _ring_size);
+        size_t first = std::min(size, (size_t)(_ring_size) - index);
+        memcpy(_ring + index, _pending.data() + _offset, first);
+        memcpy(_ring, _pending.data() + _offset + first, size - first);
+        _slot->write_pos.store(write_pos + size, std::memory_order_release);
+        _offset += size;
+    }
+    // Note: erase() keeps the capacity
+    if (_offset == _pending.size()) {
+        _pending.clear();
+        _offset = 0;
+    } else if (_offset > _pending.size() / 2) {
+        _pending.erase(0, _offset);
+        _offset = 0;
+    }
+    return _slot != nullptr;
+}
+
+void Trace_to_shared_memory::close() {
+    if (_slot) {
+        // write_pos is final: the collector frees the slot once it has read it
+        _slot->state.store(SLOT_DONE, std::memory_order_release);
+        _slot = nullptr;
+        _ring = nullptr;
+        _ring_size = 0;
+    }
+    if (_segment) {
+        munmap(_segment, _segment_size);
+        _segment = nullptr;
+        _segment_size = 0;
+    }
+    _pending.clear();
+    _offset = 0;
+}
+
+void Trace_to_shared_memory::consume_raw(const Tracer::Raw_batch& batch) {
+    if (!_slot) {
+        return;
+    }
+    // later events may refer to the batch's strings so only its events are dropped
+    _encoder.append_strings(batch, _pending);
+    if (has_room()) {
+        _encoder.append_events(batch, _pending);
+    } else {
+        _num_dropped += batch.num_events;
+    }
+    flush(0);
+}
+
+void Trace_to_shared_memory::consume_meta_events(const std::vector<std::string>& meta_events) {
+    if (_slot) {
+        _encoder.append_meta_events(meta_events, _pending);
+        flush(0);
+    }
+}
+
+void Trace_to_shared_memory::finish(const std::vector<std::string>& meta_events) {
+    assert(_state == State::EXPIRED);
+    if (_slot) {
+        _encoder.append_meta_events(meta_events, _pending);
+        _encoder.append_end(_pending);
+        if (flush(_finish_timeout) && _offset < _pending.size()) {
+            TEFLIB_TRACE_LOG("timed out writing trace to segment='{}'\n", _name);
+        }
+        close();
+        TEFLIB_TRACE_LOG("closed trace stream to segment='{}'\n", _name);
+    }
+    _state = State::COMPLETE;
+}
+
+// Stream is what the collector knows of one slot's writer
+struct Shared_memory_collector::Stream {
+    uint32_t pid { 0 };
+    uint64_t read_pos { 0 };
+    bool has_header { false };
+    bool ended { false }; // read its END record
+    bool failed { false }; // invalid: the rest is skipped
+    Binary_decoder decoder;
+    std::string bytes; // read but not yet decoded
+};
+
+Shared_memory_collector::Shared_memory_collector(const std::string& name, std::ostream& out,
+        uint32_t num_slots, size_t slot_size)
+    : _name(name), _out(out),
+    _timeline_nsec(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count())
+{
+    std::string path = get_segment_path(_name);
+    if (num_slots == 0 || slot_size == 0) {
+        return;
+    }
+    shm_unlink(path.c_str()); // left by an earlier run
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        TEFLIB_TRACE_LOG("failed to create trace segment='{}'\n", _name);
+        return;
+    }
+    size_t size = get_segment_size(num_slots, slot_size);
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)(size)) == 0) {
+        map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        TEFLIB_TRACE_LOG("failed to map trace segment='{}'\n", _name);
+        shm_unlink(path.c_str());
+        return;
+    }
+    // Note: the new segment is zero filled and writers check the magic,
+    // which is written last
+    Trace_segment* segment = new (map) Trace_segment;
+    segment->version = SEGMENT_VERSION;
+    segment->num_slots = num_slots;
+    segment->slot_size = slot_size;
+    segment->closed.store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        Trace_segment_slot* slot = new (get_slot(segment, i)) Trace_segment_slot;
+        slot->state.store(SLOT_FREE, std::memory_order_relaxed);
+        slot->pid.store(0, std::memory_order_relaxed);
+        slot->write_pos.store(0, std::memory_order_relaxed);
+        slot->read_pos.store(0, std::memory_order_relaxed);
+        _streams.push_back(std::unique_ptr<Stream>(new Stream()));
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(segment->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    _segment = segment;
+    _segment_size = size;
+    _out << JSON_TRACE_HEADER;
+    TEFLIB_TRACE_LOG("created trace segment='{}'\n", _name);
+}
+
+Shared_memory_collector::~Shared_memory_collector() {
+    finish();
+}
+
+size_t Shared_memory_collector::poll() {
+    if (!_segment) {
+        return 0;
+    }
+    size_t num_read = 0;
+    std::string json;
+    for (uint32_t i = 0; i < _segment->num_slots; ++i) {
+        Trace_segment_slot* slot = get_slot(_segment, i);
+        Stream& stream = *_streams[i];
+        uint32_t state = slot->state.load(std::memory_order_acquire);
+        if (state != SLOT_ACTIVE && state != SLOT_DONE) {
+            continue;
+        }
+        if (stream.pid == 0) {
+            stream.pid = slot->pid.load(std::memory_order_relaxed);
+            ++_num_attached;
+            TEFLIB_TRACE_LOG("trace segment='{}' attached pid={}\n", _name, stream.pid);
+        }
+        // Note: check for a dead writer before reading so we read all it wrote
+        bool gone = state == SLOT_ACTIVE && kill((pid_t)(stream.pid), 0) == -1 && errno == ESRCH;
+
+        uint64_t write_pos = slot->write_pos.load(std::memory_order_acquire);
+        uint64_t size = write_pos - stream.read_pos;
+        if (size > 0) {
+            const char* ring = get_ring(slot);
+            size_t index = (size_t)(stream.read_pos % _segment->slot_size);
+            size_t first = (size_t)(std::min<uint64_t>(size, _segment->slot_size - index));
+            if (!stream.failed) {
+                stream.bytes.append(ring + index, first);
+                stream.bytes.append(ring, (size_t)(size) - first);
+            }
+            stream.read_pos = write_pos;
+            slot->read_pos.store(write_pos, std::memory_order_release);
+            num_read += (size_t)(size);
+        }
+        decode(stream, json);
+
+        if (state == SLOT_DONE || gone) {
+            if (!stream.ended) {
+                TEFLIB_TRACE_LOG("trace stream of pid={} is truncated\n", stream.pid);
+            }
+            slot->pid.store(0, std::memory_order_relaxed);
+            slot->write_pos.store(0, std::memory_order_relaxed);
+            slot->read_pos.store(0, std::memory_order_relaxed);
+            slot->state.store(SLOT_FREE, std::memory_order_release);
+            stream = Stream();
+            --_num_attached;
+            ++_num_finished;
+        }
+    }
+    _out.write(json.data(), json.size());
+    return num_read;
+}
+
+void Shared_memory_collector::decode(Stream& stream, std::string& json) {
+    // decode the whole records and keep the rest for next time
+    size_t decoded = 0;
+    while (!stream.failed && !stream.ended) {
+        Memory_buffer buffer(stream.bytes.data() + decoded, stream.bytes.size() - decoded);
+        Binary_reader reader(buffer);
+        Binary_decoder::Result result;
+        if (!stream.has_header) {
+            result = stream.decoder.decode_header(reader);
+            if (result == Binary_decoder::RECORD) {
+                stream.has_header = true;
+                stream.decoder.set_timeline_nsec(_timeline_nsec);
+                stream.decoder.append_clock_sync(json, _first);
+            }
+        } else {
+            result = stream.decoder.decode_record(reader, json, _first);
+        }
+        if (result == Binary_decoder::INCOMPLETE) {
+            break;
+        }
+        decoded += buffer.get_offset();
+        if (result == Binary_decoder::INVALID) {
+            TEFLIB_TRACE_LOG("invalid trace stream from pid={}\n", stream.pid);
+            stream.failed = true;
+        } else if (result == Binary_decoder::END) {
+            stream.ended = true;
+        }
+    }
+    if (stream.failed || stream.ended) {
+        stream.bytes.clear();
+    } else {
+        stream.bytes.erase(0, decoded);
+    }
+}
+
+void Shared_memory_collector::finish() {
+    if (!_segment) {
+        return;
+    }
+    poll();
+    _segment->closed.store(1, std::memory_order_release);
+    _out << "\n]\n}\n";
+    _out.flush();
+    munmap(_segment, _segment_size);
+    _segment = nullptr;
+    shm_unlink(get_segment_path(_name).c_str());
+    TEFLIB_TRACE_LOG("closed trace segment='{}'\n", _name);
+}
+#endif // _WIN32
+
+uint32_t Latency_histogram::get_bucket_index(uint64_t value) {
+    if (value < SUB_BUCKET_COUNT) {
+        return (uint32_t)(value);
+    }
+    uint32_t exponent = highest_bit_index(value);
+    uint32_t shift = exponent - SUB_BUCKET_BITS;
+    return ((shift + 1) << SUB_BUCKET_BITS) | (uint32_t)((value >> shift) & (SUB_BUCKET_COUNT - 1));
+}
+
+uint64_t Latency_histogram::get_bucket_low(uint32_t index) {
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+    uint32_t shift = (index >> SUB_BUCKET_BITS) - 1;
+    uint64_t mantissa = (index & (SUB_BUCKET_COUNT - 1)) | SUB_BUCKET_COUNT;
+    return mantissa << shift;
+}
+
+uint64_t Latency_histogram::get_bucket_high(uint32_t index) {
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+    uint32_t shift = (index >> SUB_BUCKET_BITS) - 1;
+    return get_bucket_low(index) + ((uint64_t(1) << shift) - 1);
+}
+
+void Latency_histogram::record(uint64_t value) {
+    ++_buckets[get_bucket_index(value)];
+    ++_count;
+    _sum += value;
+    _min = std::min(_min, value);
+    _max = std::max(_max, value);
+}
+
+uint64_t Latency_histogram::get_percentile(double percentile) const {
+    if (_count == 0) {
+        return 0;
+    }
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    uint64_t rank = (uint64_t)(std::ceil(percentile * 0.01 * (double)(_count)));
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+        total += _buckets[i];
+        if (total >= rank) {
+            return std::min(get_bucket_high(i), _max);
+        }
+    }
+    return _max;
+}
+
+Trace_to_histograms::Entry& Trace_to_histograms::get_entry(String_id name, String_id cat, String_id tid) {
+    uint64_t key = ((uint64_t)(name) << 32) | cat;
+    Entry*& entry = _index[tid][key];
+    if (!entry) {
+        _entries.push_back(std::unique_ptr<Entry>(new Entry()));
+        entry = _entries.back().get();
+        entry->name = name;
+        entry->cat = cat;
+        entry->tid = tid;
+    }
+    return *entry;
+}
+
+void Trace_to_histograms::consume_raw(const Tracer::Raw_batch& batch) {
+    // histograms are in nsec
+    uint64_t nsec_per_unit = NSEC_PER_SECOND / batch.ts_units_per_second;
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t begin = 0;
+    for (size_t i = 0; i < batch.num_ranges; ++i) {
+        const Tracer::Thread_range& range = batch.ranges[i];
+        // consecutive events are often from the same scope
+        Entry* entry = nullptr;
+        for (size_t j = begin; j < range.end; ++j) {
+            const Tracer::Event& event = batch.events[j];
+            if (event.ph != Phase::Complete) {
+                continue;
+            }
+            if (!entry || entry->name != event.name || entry->cat != event.cat) {
+                entry = &get_entry(event.name, event.cat, range.tid);
+            }
+            entry->histogram.record(event.dur * nsec_per_unit);
+        }
+        begin = range.end;
+    }
+}
+
+std::vector<Trace_to_histograms::Entry> Trace_to_histograms::get_snapshot(bool reset) {
+    std::vector<Entry> snapshot;
+    std::lock_guard<std::mutex> lock(_mutex);
+    snapshot.reserve(_entries.size());
+    for (const auto& entry : _entries) {
+        snapshot.push_back(*entry);
+    }
+    if (reset) {
+        _entries.clear();
+        _index.clear();
+    }
+    return snapshot;
+}
+
+bool tef::convert_binary_trace(std::istream& in, std::ostream& out) {
+    Binary_reader reader(*in.rdbuf());
+    Binary_decoder decoder;
+    if (decoder.decode_header(reader) != Binary_decoder::RECORD) {
+        return false;
+    }
+    bool first = true;
+    std::string json;
+    out << JSON_TRACE_HEADER;
+    decoder.append_clock_sync(json, first);
+    Binary_decoder::Result result = Binary_decoder::RECORD;
+    while (result == Binary_decoder::RECORD) {
+        out.write(json.data(), json.size());
+        json.clear();
+        result = decoder.decode_record(reader, json, first);
+        if (result == Binary_decoder::INVALID) {
+            return false;
+        }
+    }
+    out << "\n]\n}\n";
+    return result == Binary_decoder::END;
+}
+
+bool tef::recover_json_trace(std::istream& in, std::ostream& out) {
+    const std::string HEADER = JSON_TRACE_HEADER;
+    const std::string TRAILER = "\n]\n}";
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    std::string block;
+    auto read_block = [&](std::streamoff start, std::streamoff end) {
+        block.resize((size_t)(end - start));
+        in.seekg(start);
+        in.read(&block[0], (std::streamsize)block.size());
+        return (bool)in;
+    };
+    if (size < (std::streamoff)HEADER.size() || !read_block(0, HEADER.size()) || block != HEADER) {
+        return false;
+    }
+
+    // skip the zero padding of a preallocated file
+    constexpr std::streamoff BLOCK_SIZE = 1 << 16;
+    std::streamoff data_end = size;
+    while (data_end > (std::streamoff)HEADER.size()) {
+        std::streamoff start = std::max(data_end - BLOCK_SIZE, (std::streamoff)HEADER.size());
+        if (!read_block(start, data_end)) {
+            return false;
+        }
+        size_t n = block.find_last_not_of('\0');
+        if (n != std::string::npos) {
+            data_end = start + (std::streamoff)n + 1;
+            break;
+        }
+        data_end = start;
+    }
+
+    // Every event written by a teflib consumer ends with ",\n" (newlines in
+    // strings are escaped) so anything after the last one is a partial event.
+    // A trace that already ends with the trailer is complete.
+    std::streamoff cut = HEADER.size(); // keep [0, cut)
+    bool complete = false;
+    std::streamoff end = data_end;
+    while (end > (std::streamoff)HEADER.size()) {
+        // blocks overlap by a byte so ",\n" is found across a boundary
+        std::streamoff start = std::max(end - BLOCK_SIZE, (std::streamoff)HEADER.size());
+        if (!read_block(start, std::min(end + 1, data_end))) {
+            return false;
+        }
+        if (end == data_end) {
+            size_t last = block.find_last_not_of("\n");
+            if (last != std::string::npos && last + 1 >= TRAILER.size()
+                    && block.compare(last + 1 - TRAILER.size(), TRAILER.size(), TRAILER) == 0) {
+                complete = true;
+                cut = data_end;
+                break;
+            }
+        }
+        size_t n = block.rfind(",\n");
+        if (n != std::string::npos) {
+            cut = start + (std::streamoff)n;
+            break;
+        }
+        end = start;
+    }
+
+    in.clear();
+    for (std::streamoff start = 0; start < cut; start += BLOCK_SIZE) {
+        if (!read_block(start, std::min(start + BLOCK_SIZE, cut))) {
+            return false;
+        }
+        out.write(block.data(), (std::streamsize)block.size());
+    }
+    if (!complete) {
+        out << "\n]\n}\n";
+        TEFLIB_TRACE_LOG("recovered trace: dropped {} bytes\n", (uint64_t)(data_end - cut));
     }
+    return (bool)out;
 }
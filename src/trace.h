@@ -19,21 +19,40 @@
 //
 // (5) In any context for which you want to measure duration add a macro: TRACE_CONTEXT("name", "category")
 //     No more than one instance of this macro in each context level.
+//     The name and category must be string literals (use TRACE_CONTEXT_DYNAMIC otherwise).
 //
 // (6) Compile project with -DUSE_TEF
+//
+// (7) Optionally compile out whole categories or levels of detail with
+//     -DTEF_COMPILED_CATEGORIES='"cat1,cat2"' and -DTEF_MIN_LEVEL=n
+//     (see TRACE_CONTEXT_L)
 
 #pragma once
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <fstream>
 #include <cassert>
 #include <string>
 
+#ifdef TEF_USE_ZLIB
+#include <zlib.h>
+#endif // TEF_USE_ZLIB
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // _MSC_VER
+
 // to avoid dependency on fmt compile with -DNO_FMT
 #define NO_FMT
 #ifdef NO_FMT
@@ -42,10 +61,31 @@
 #include <fmt/format.h>
 #endif
 
+// branch hints for the paths taken while tracing is idle
+#if defined(__GNUC__) || defined(__clang__)
+#define TEF_LIKELY(x) __builtin_expect(!!(x), 1)
+#define TEF_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define TEF_LIKELY(x) (x)
+#define TEF_UNLIKELY(x) (x)
+#endif
+
+// categories whose TRACE_CONTEXT etc. are compiled in (empty is all)
+#ifndef TEF_COMPILED_CATEGORIES
+#define TEF_COMPILED_CATEGORIES ""
+#endif // TEF_COMPILED_CATEGORIES
+
+// TRACE_CONTEXT_L sites of lower level are compiled out
+#ifndef TEF_MIN_LEVEL
+#define TEF_MIN_LEVEL 0
+#endif // TEF_MIN_LEVEL
+
 namespace tef {
 
 constexpr uint64_t DISTANT_FUTURE = uint64_t(-1);
 constexpr uint64_t MSEC_PER_SECOND = 1e3;
+constexpr uint64_t USEC_PER_SECOND = 1e6;
+constexpr uint64_t NSEC_PER_SECOND = 1e9;
 
 // The goal here is to provide a fast+simple trace tool rather than a
 // complete one.  As a consequence not all Phase types are supported.
@@ -54,13 +94,11 @@ enum Phase : char {
     // supported:
     DurationBegin = 'B',
     DurationEnd = 'E',
+    Complete = 'X', // what TRACE_CONTEXT records
     Counter = 'C',
     Metadata = 'M',
 
-    // unsupported:
-    Complete = 'X',
-    Instant = 'i',
-
+    // supported with an id (see has_id()):
     AsyncNestableStart = 'b',
     AsyncNestableInstant = 'n',
     AsyncNestableEnd = 'e',
@@ -69,6 +107,9 @@ enum Phase : char {
     FlowStep = 't',
     FlowEnd = 'f',
 
+    // unsupported:
+    Instant = 'i',
+
     Sample = 'P',
 
     ObjectCreated = 'N',
@@ -86,20 +127,270 @@ enum Phase : char {
     ContextLeave = ')'
 };
 
+// async and flow events carry an id (which ties them together) instead of a dur
+inline bool has_id(Phase ph) {
+    return ph == AsyncNestableStart || ph == AsyncNestableInstant || ph == AsyncNestableEnd
+        || ph == FlowStart || ph == FlowStep || ph == FlowEnd;
+}
+
+// index of the lowest (or highest) set bit of value, which must not be 0
+inline uint32_t lowest_bit_index(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (uint32_t)(index);
+#else
+    return (uint32_t)(__builtin_ctzll(value));
+#endif
+}
+
+inline uint32_t highest_bit_index(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (uint32_t)(index);
+#else
+    return 63 - (uint32_t)(__builtin_clzll(value));
+#endif
+}
+
 uint64_t get_now_msec();
 
+// the id of this process (as from getpid())
+uint32_t get_process_id();
+
+// String_id is a small integer handle for an interned name or category
+typedef uint32_t String_id;
+
+// Category_mask has one bit per category name (see Tracer::get_category_mask())
+typedef uint64_t Category_mask;
+constexpr Category_mask ALL_CATEGORIES = ~Category_mask(0);
+
+// Arg is one typed key/value pair attached to an event.  Values are stored
+// raw and are only formatted into JSON when events are harvested.
+struct Arg {
+    enum Type : uint8_t {
+        INT,
+        UINT,
+        DOUBLE,
+        BOOL,
+        STRING, // interned
+        JSON    // legacy pre-formatted "\"key\":value,..." text (no key)
+    };
+
+    String_id key;
+    Type type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        bool b;
+        String_id str;
+        struct {
+            uint32_t offset;
+            uint32_t size;
+        } text;
+    } value;
+};
+
+// make_arg() overloads pick the Arg::Type from the value type
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, Arg>::type
+make_arg(String_id key, T value) {
+    Arg arg;
+    arg.key = key;
+    arg.type = Arg::INT;
+    arg.value.i = value;
+    return arg;
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, Arg>::type
+make_arg(String_id key, T value) {
+    Arg arg;
+    arg.key = key;
+    arg.type = Arg::UINT;
+    arg.value.u = value;
+    return arg;
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, Arg>::type
+make_arg(String_id key, T value) {
+    Arg arg;
+    arg.key = key;
+    arg.type = Arg::DOUBLE;
+    arg.value.d = value;
+    return arg;
+}
+
+inline Arg make_arg(String_id key, bool value) {
+    Arg arg;
+    arg.key = key;
+    arg.type = Arg::BOOL;
+    arg.value.b = value;
+    return arg;
+}
+
+// Note: string values are interned, so they should come from a small set
+// (e.g. an enum name) rather than be unique per event.
+Arg make_arg(String_id key, const std::string& value);
+Arg make_arg(String_id key, const char* value);
+
+// Clock is the Tracer's timestamp source.  ticks() reads a counter which is
+// cheap and increasing on each thread: the TSC on x86-64, cntvct_el0 on
+// aarch64 and steady_clock nanoseconds elsewhere (or when compiled with
+// -DTEF_USE_STEADY_CLOCK).  A TSC that isn't invariant (its rate follows
+// the core's frequency) can't be converted to time, so then the Clock uses
+// steady_clock nanoseconds instead.  Counter ticks are only converted to
+// time at export, at a rate calibrated against steady_clock over the first
+// 20ms: the Tracer calibrates from its harvester thread (or before taking
+// its harvest lock) so the wait never holds up anything else.
+class Clock {
+public:
+#if defined(TEF_USE_STEADY_CLOCK) || !(defined(__x86_64__) || defined(__aarch64__))
+    static constexpr bool IS_STEADY_CLOCK = true;
+#else
+    static constexpr bool IS_STEADY_CLOCK = false;
+#endif
+
+    static uint64_t counter_ticks() {
+#if defined(TEF_USE_STEADY_CLOCK) || !(defined(__x86_64__) || defined(__aarch64__))
+        return steady_ticks();
+#elif defined(__x86_64__)
+        uint32_t lo, hi;
+        __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+        return ((uint64_t)(hi) << 32) | lo;
+#else
+        uint64_t t;
+        __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (t));
+        return t;
+#endif
+    }
+    static uint64_t steady_ticks() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    // does counter_ticks() run at a constant rate (CPUID says the TSC is
+    // invariant; the aarch64 generic timer always is)
+    static bool has_invariant_counter();
+
+    // use_counter false forces steady_clock ticks (as does a counter
+    // without a constant rate)
+    explicit Clock(bool use_counter = true);
+
+    uint64_t ticks() const { return TEF_LIKELY(_use_counter) ? counter_ticks() : steady_ticks(); }
+    bool uses_counter() const { return _use_counter; }
+
+    // usec since the Clock was created
+    uint64_t to_usec(uint64_t ticks) const {
+        return ticks > _origin ? (uint64_t)((double)(ticks - _origin) * usec_per_tick()) : 0;
+    }
+    // nsec since the Clock was created
+    uint64_t to_nsec(uint64_t ticks) const {
+        return ticks > _origin ? (uint64_t)((double)(ticks - _origin) * (1.0e3 * usec_per_tick())) : 0;
+    }
+    uint64_t usec_to_ticks(uint64_t usec) const { return (uint64_t)((double)(usec) / usec_per_tick()); }
+
+    // steady_clock time of the Clock's creation (nsec since its epoch),
+    // which is ts 0 of exported events
+    uint64_t get_origin_nsec() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(_origin_time.time_since_epoch()).count();
+    }
+
+    double usec_per_tick() const {
+        calibrate();
+        return _usec_per_tick;
+    }
+
+    // measure the counter's rate, once: sleeps until 20ms have passed since
+    // the Clock was created if need be
+    void calibrate() const {
+        if (_use_counter) {
+            std::call_once(_calibrated, &Clock::measure_rate, this);
+        }
+    }
+
+private:
+    void measure_rate() const;
+
+    bool _use_counter { false };
+    std::chrono::steady_clock::time_point _origin_time;
+    uint64_t _origin { 0 };
+    mutable double _usec_per_tick { 1.0e-3 };
+    mutable std::once_flag _calibrated;
+};
+
 // Note: Tracer is a singleton
 class Tracer {
 public:
 
+    // Note: Event does not store 'pid' because all events are
+    // for this process (see get_pid()), nor 'tid' because
+    // each Thread_buffer only ever holds events from one thread.
+    struct Event {
+        uint64_t ts;
+        union {
+            uint64_t dur;
+            uint64_t id; // when has_id(ph)
+        };
+        String_id name;
+        String_id cat;
+        uint32_t args_begin;
+        uint8_t num_args;
+        Phase ph;
+        uint16_t depth; // scopes open on the thread (enclosing it, if Complete)
+    };
+
+    // a run of one thread's events: they end at index end
+    struct Thread_range {
+        String_id tid; // interned text of the thread id
+        size_t end;
+    };
+
+    // Batch_owner keeps a batch's memory alive.  A consumer which holds on
+    // to a batch after consume_batch() or consume_raw() returns (e.g. to
+    // process it on another thread) keeps a copy of the batch, owner
+    // included, rather than copying its data.  Shared data is immutable.
+    typedef std::shared_ptr<const void> Batch_owner;
+
+    // Raw_batch is one harvest of events before serialization, for
+    // consumers that store or aggregate events in their own format.
+    // Event args are args[args_begin, args_begin + num_args) and Arg::JSON
+    // text is in text.  Every String_id is an index into strings.
+    struct Raw_batch {
+        const Event* events;
+        size_t num_events;
+        const Thread_range* ranges;
+        size_t num_ranges;
+        const Arg* args;
+        const char* text;
+        const std::string* strings;
+        size_t num_strings;
+        uint64_t ts_units_per_second; // of Event ts and dur
+        Batch_owner owner;
+    };
+
+    // Batch is one harvest of events serialized as JSON, each followed by
+    // ",\n", ready to be written out as is.  Event i ends (before its
+    // separator) at data + ends[i].
+    struct Batch {
+        const char* data;
+        size_t size;
+        const size_t* ends;
+        size_t num_events;
+        Batch_owner owner;
+    };
+
     // To harvest trace events the pattern is:
     // (1) create a Consumer and give pointer to Tracer
-    // (2) override consume_events() to do what you want with events
+    // (2) override consume_batch() or consume_events() to do what you want with events
     // (3) when consumer is COMPLETE close and delete
     // (Tracer automatically removes consumer before COMPLETE)
     class Consumer {
     public:
         friend class Tracer;
+        friend class Queued_consumer;
 
         enum State : uint8_t {
             ACTIVE,  // collecting events
@@ -107,11 +398,17 @@ public:
             COMPLETE // all done (has collected meta_events)
         };
 
-        Consumer(uint64_t lifetime) {
-            // Note: lifetime is limited because the chrome://tracing tool
+        // JSON consumers receive consume_batch(), RAW ones consume_raw()
+        enum Format : uint8_t {
+            JSON,
+            RAW
+        };
+
+        Consumer(uint64_t lifetime, Format format = JSON) : _format(format) {
+            // Note: JSON lifetime is limited because the chrome://tracing tool
             // can crash when browsing very large files
             constexpr uint64_t MAX_TRACE_CONSUMER_LIFETIME = 10 * MSEC_PER_SECOND;
-            if (lifetime > MAX_TRACE_CONSUMER_LIFETIME) {
+            if (format == JSON && lifetime > MAX_TRACE_CONSUMER_LIFETIME) {
                 lifetime = MAX_TRACE_CONSUMER_LIFETIME;
             }
             _lifetime = lifetime;
@@ -119,13 +416,42 @@ public:
 
         virtual ~Consumer() {}
 
-        // override this pure virtual method to Do Stuff with events
+        // override consume_batch() to receive each harvest as one block of
+        // bytes (e.g. for a single write to a file or socket)
+        // Note: by default it splits the batch and calls consume_events()
+        virtual void consume_batch(const Batch& batch);
+
+        // or override consume_events() to Do Stuff with events one by one:
         // each event will be a JSON string as per the google tracing API
-        virtual void consume_events(const std::vector<std::string>& events) = 0;
+        virtual void consume_events(const std::vector<std::string>& /*events*/) { }
+
+        // RAW consumers override consume_raw() instead
+        virtual void consume_raw(const Raw_batch& /*batch*/) { }
+
+        // consume_meta_events() receives thread metadata (names and sort
+        // indices) as it appears, ahead of the events which need it, while
+        // process metadata comes with finish().
+        // Note: by default it calls consume_events()
+        virtual void consume_meta_events(const std::vector<std::string>& meta_events) {
+            consume_events(meta_events);
+        }
+
+        Format get_format() const { return _format; }
+        uint64_t get_lifetime() const { return _lifetime; } // msec
+
+        // set_categories() limits tracing to the comma separated categories
+        // (e.g. "net,alloc"), or all categories when empty or "*" (the
+        // default).  The Tracer records the union of its consumers'
+        // categories and all consumers receive all recorded events.
+        // Note: call this before add_consumer()
+        void set_categories(const std::string& categories);
+        Category_mask get_categories() const { return _categories; }
 
         // called by Tracer on add
         // but can also be used to change expiry on the fly
-        void update_expiry(uint64_t now) { _expiry = now + _lifetime; }
+        void update_expiry(uint64_t now) {
+            _expiry = (_lifetime < DISTANT_FUTURE - now) ? now + _lifetime : DISTANT_FUTURE;
+        }
 
         bool is_expired() const { return _state == State::EXPIRED; };
         bool is_complete() const { return _state == State::COMPLETE; }
@@ -138,6 +464,9 @@ public:
         }
 
         // called by Tracer after expired
+        // Note: overrides must set COMPLETE last, since the owner may delete
+        // the consumer as soon as it sees is_complete() from another thread
+        // (e.g. when the Tracer has a harvester thread).
         virtual void finish(const std::vector<std::string>& meta_events) {
             assert(_state == State::EXPIRED);
             consume_events(meta_events);
@@ -146,8 +475,12 @@ public:
 
     protected:
         uint64_t _lifetime; // msec
-        uint64_t _expiry { DISTANT_FUTURE };
-        State _state { State::ACTIVE };
+        Format _format;
+        Category_mask _categories { ALL_CATEGORIES };
+        std::atomic<uint64_t> _expiry { DISTANT_FUTURE };
+        std::atomic<State> _state { State::ACTIVE };
+        std::vector<std::string> _event_strings; // for default consume_batch()
+        uint64_t _thread_meta_version { 0 }; // delivered so far (by Tracer)
     };
 
     static Tracer& instance() {
@@ -155,29 +488,167 @@ public:
         return (*_instance);
     }
 
-    // helper
+    // helper: the calling thread's tid as written to the trace
+    // (a small sequential number rather than the std::thread::id)
     static std::string thread_id_as_string();
 
-    Tracer() : _start_time(std::chrono::high_resolution_clock::now()) { }
-
-    uint64_t now() const {
-        uint64_t t = std::chrono::duration_cast<std::chrono::microseconds>(
-            std::chrono::high_resolution_clock::now() - _start_time).count();
-        // BUG: chrome://tracing sometimes won't correctly organize embedded
-        // events with simultaneous start times!
-        // WORKAROUND: We make sure now() always returns an increasing value.
-        // This introduces slight error on measurements and an effective event
-        // rate limit of about 0.5MHz.  If you need sub-microsecond accuracy
-        // or if your events are arriving faster than 0.5MHz then teflib is
-        // probably NOT the right tool for your job.
-        if (t <= _last_t)
-        {
-            t = _last_t + 1;
+    Tracer() : _pid(get_process_id()), _pid_str(std::to_string(_pid)) {
+        for (auto& threshold : _sample_thresholds) {
+            threshold.store(UINT64_MAX, std::memory_order_relaxed);
         }
-        _last_t = t;
-        return t;
+        set_clock_sync_event();
+    }
+    ~Tracer();
+
+    // now() returns raw Clock ticks: cheap, and increasing on each thread.
+    // Timestamps handed to add_event() etc are in these ticks.
+    uint64_t now() const { return _clock.ticks(); }
+    const Clock& get_clock() const { return _clock; }
+
+    // pid written with every event, taken when the Tracer is created
+    // (so a forked child which keeps tracing reports its parent's)
+    uint32_t get_pid() const { return _pid; }
+    const std::string& get_pid_string() const { return _pid_str; }
+
+    // The meta events include a clock_sync event ("ph":"c") which ties
+    // ts 0 to steady_clock time so traces of several processes on one
+    // machine can be lined up.  Binary streams carry the same in their
+    // header instead.
+    const std::string& get_clock_sync_event() const { return _clock_sync_event; }
+
+    // intern() returns the same String_id every time it is given the same
+    // string.  It takes a lock so hot paths should intern once and keep the
+    // id (which is what the TRACE_CONTEXT macro does via Call_site).
+    // Interned strings are never freed.
+    String_id intern(const std::string& str);
+    std::string get_string(String_id id) const;
+
+    // intern_literal() is for strings with static storage duration
+    // (e.g. string literals): it is looked up by address in a small
+    // per-thread cache and so neither locks nor allocates after the
+    // first call on each thread.
+    String_id intern_literal(const char* str);
+
+    // get_category_mask() returns the bits of the comma separated
+    // category names in cat: each distinct name gets its own bit, except
+    // that names beyond the 63rd all share the last one.  Masks never
+    // change and the String_id version is cached per thread.
+    Category_mask get_category_mask(String_id cat);
+    Category_mask get_category_mask(const std::string& categories);
+
+    // is_enabled() is true when any category is being traced, or only
+    // those in mask: either way it is one relaxed load of a static, so the
+    // trace macros check it before they call instance()
+    static bool is_enabled() { return _enabled_categories.load(std::memory_order_relaxed) != 0; }
+    static bool is_enabled(Category_mask mask) {
+        return (_enabled_categories.load(std::memory_order_relaxed) & mask) != 0;
+    }
+    bool is_category_enabled(String_id cat) {
+        return is_enabled() && is_enabled(get_category_mask(cat));
+    }
+
+    // set_sampling() makes TRACE_CONTEXT record only about 1 in rate of the
+    // scopes in the comma separated categories (rate 1 records them all).
+    // Each scope is decided at construction with a per-thread PRNG, and a
+    // scope in several sampled categories uses the rate of its first one.
+    // The rates are written to the trace as "sample_rate" metadata so that
+    // tools can scale counts back up.
+    void set_sampling(const std::string& categories, uint32_t rate);
+
+    // is_sampled() is true when a scope in mask's categories should be recorded
+    bool is_sampled(Category_mask mask) const {
+        Category_mask sampled = mask & _sampled_categories.load(std::memory_order_relaxed);
+        if (sampled == 0) {
+            return true;
+        }
+        uint32_t bit = lowest_bit_index(sampled);
+        return next_random() < _sample_thresholds[bit].load(std::memory_order_relaxed);
     }
 
+    void add_event(String_id name, String_id cat, Phase ph, uint64_t ts=0, uint64_t dur=0);
+    void add_event_with_args(
+            String_id name,
+            String_id cat,
+            Phase ph,
+            const Arg* args,
+            uint32_t num_args,
+            uint64_t ts=0, uint64_t dur=0);
+    // Note: args = "{\"key\":value,...}" is legacy pre-formatted JSON
+    void add_event_with_args(
+            String_id name,
+            String_id cat,
+            Phase ph,
+            const std::string& args,
+            uint64_t ts=0, uint64_t dur=0);
+    // both, as a Context with typed and legacy args records (json_args
+    // come last and take one of the event's args)
+    void add_event_with_args(
+            String_id name,
+            String_id cat,
+            Phase ph,
+            const Arg* args,
+            uint32_t num_args,
+            const std::string& json_args,
+            uint64_t ts=0, uint64_t dur=0);
+    void set_counter(String_id name, String_id cat, int64_t count);
+    // set_counters() records several series in one counter event (drawn
+    // stacked by chrome://tracing): each Arg's key names a series
+    void set_counters(String_id name, String_id cat, const Arg* series, uint32_t num_series);
+
+    // add_event_with_id() records an async or flow event (see has_id()):
+    // events with the same name, cat and id are tied together across threads
+    void add_event_with_id(String_id name, String_id cat, Phase ph, uint64_t id, uint64_t ts=0);
+
+    // string literal versions use intern_literal()
+    template <size_t N, size_t M>
+    void add_event(const char (&name)[N], const char (&cat)[M], Phase ph, uint64_t ts=0, uint64_t dur=0) {
+        if (is_enabled()) {
+            add_event(intern_literal(name), intern_literal(cat), ph, ts, dur);
+        }
+    }
+    template <size_t N, size_t M>
+    void add_event_with_args(
+            const char (&name)[N],
+            const char (&cat)[M],
+            Phase ph,
+            const Arg* args,
+            uint32_t num_args,
+            uint64_t ts=0, uint64_t dur=0) {
+        if (is_enabled()) {
+            add_event_with_args(intern_literal(name), intern_literal(cat), ph, args, num_args, ts, dur);
+        }
+    }
+    template <size_t N, size_t M>
+    void add_event_with_args(
+            const char (&name)[N],
+            const char (&cat)[M],
+            Phase ph,
+            const std::string& args,
+            uint64_t ts=0, uint64_t dur=0) {
+        if (is_enabled()) {
+            add_event_with_args(intern_literal(name), intern_literal(cat), ph, args, ts, dur);
+        }
+    }
+    template <size_t N, size_t M>
+    void add_event_with_id(const char (&name)[N], const char (&cat)[M], Phase ph, uint64_t id, uint64_t ts=0) {
+        if (is_enabled()) {
+            add_event_with_id(intern_literal(name), intern_literal(cat), ph, id, ts);
+        }
+    }
+    template <size_t N, size_t M>
+    void set_counter(const char (&name)[N], const char (&cat)[M], int64_t count) {
+        if (is_enabled()) {
+            set_counter(intern_literal(name), intern_literal(cat), count);
+        }
+    }
+    template <size_t N, size_t M>
+    void set_counters(const char (&name)[N], const char (&cat)[M], const Arg* series, uint32_t num_series) {
+        if (is_enabled()) {
+            set_counters(intern_literal(name), intern_literal(cat), series, num_series);
+        }
+    }
+
+    // these intern on every call: prefer the versions above
     void add_event(const std::string& name, const std::string& cat, Phase ph, uint64_t ts=0, uint64_t dur=0);
     void add_event_with_args(
             const std::string& name,
@@ -187,7 +658,8 @@ public:
             uint64_t ts=0, uint64_t dur=0);
     void set_counter(const std::string& name, const std::string& cat, int64_t count);
 
-    // type = process_name, process_lables, or thread_name
+    // type = process_name, process_labels (comma separated), or thread_name
+    // Note: each replaces any earlier one of its type (for its thread)
     void add_meta_event(const std::string& type, const std::string& arg);
 
     // type = process_sort_index, or thread_sort_index
@@ -197,90 +669,663 @@ public:
     void advance_consumers();
     void shutdown();
 
+    // start_harvester() moves harvesting off the mainloop: a thread owned by
+    // the Tracer collects, serializes and feeds events to consumers every
+    // interval msec.  While it runs advance_consumers() calls from other
+    // threads return immediately, so TRACE_MAINLOOP may be left in place.
+    // With sample_interval (usec) > 0 it also calls sample_counters() that often.
+    void start_harvester(uint64_t interval, uint64_t sample_interval = 0);
+    void stop_harvester();
+    bool has_harvester() const { return _harvester_running.load(); }
+
+    // set_serializer_threads() serializes harvests of at least min_events
+    // events in parallel, in num_threads slices: one on the harvesting
+    // thread and the others on Tracer-owned workers.  The slices are
+    // concatenated in order so consumers see the same batch either way.
+    // num_threads 0 or 1 (the default) serializes on the harvesting thread.
+    void set_serializer_threads(uint32_t num_threads, size_t min_events = 64 * 1024);
+
+    // Sampled counters are polled rather than set: sample_counters() reads
+    // every registered sampler and records one counter event per name, with
+    // samplers that share a name and cat recorded as series of that event.
+    // Samplers run on the thread calling sample_counters() (the harvester's
+    // when started with a sample_interval) so they must be thread safe.
+    typedef std::function<int64_t()> Counter_sampler;
+    void add_counter_sampler(const std::string& name, const std::string& cat,
+            const std::string& series, Counter_sampler sampler);
+    // value must outlive its sampler: remove it first
+    void add_counter_sampler(const std::string& name, const std::string& cat,
+            const std::string& series, const std::atomic<int64_t>& value);
+    void remove_counter_samplers(const std::string& name, const std::string& cat);
+    void sample_counters();
+
     // don't call remove_consumer() unless you know what you're doing
     // (e.g. shutting down before consumers are complete)
+    // Note: it waits for a harvest in progress, so never call it from a consumer
     void remove_consumer(Consumer* consumer);
 
-    size_t get_num_events() const { return _events.size(); }
+    // number of events waiting to be harvested (approximate)
+    size_t get_num_events() const;
+
+    // Stats are the Tracer's own costs since it was created.  Each trace
+    // ends with a copy of them as "teflib_stats" metadata.
+    struct Stats {
+        uint64_t events_harvested { 0 };
+        uint64_t events_discarded { 0 }; // harvested with no consumer to take them
+        uint64_t args_dropped { 0 }; // beyond MAX_EVENT_ARGS or too big for a chunk
+        uint64_t bytes_serialized { 0 }; // JSON
+        uint64_t chunks_allocated { 0 }; // event chunks (not counting reuse)
+        uint64_t harvests { 0 };
+        uint64_t harvest_nsec { 0 }; // total
+        uint64_t max_harvest_nsec { 0 };
+    };
+    Stats get_stats() const;
+
+    // Flight recorder mode keeps tracing always on without unbounded memory:
+    // each thread records into a preallocated ring of chunks_per_thread
+    // chunks (about 40KB each) which overwrites its oldest events, and
+    // nothing is harvested until a snapshot is requested.
+    // Call enable_flight_recorder() once, before any events are recorded.
+    void enable_flight_recorder(uint32_t chunks_per_thread);
+    bool is_flight_recorder() const { return _ring_size > 0; }
+
+    // request_snapshot() asks the Tracer to feed the last window msec of
+    // flight recorder events to consumer on the next advance_consumers(),
+    // after which consumer will be COMPLETE.  It only stores the request
+    // (it does not lock or allocate) so it is safe to call from a signal
+    // handler.  Returns false if a snapshot is already pending.
+    bool request_snapshot(Consumer* consumer, uint64_t window);
+
+    // Nanosecond precision mode exports ts and dur of all events in nsec
+    // (written to JSON as fractional usec, e.g. "dur":0.085) so short
+    // scopes can be measured: by default they are rounded to whole usec.
+    // Call set_nanosecond_precision() once, before any events are recorded.
+    void set_nanosecond_precision(bool enabled) { _nanosecond_precision = enabled; }
+    bool has_nanosecond_precision() const { return _nanosecond_precision.load(std::memory_order_relaxed); }
+
+    // Sorted export writes the events of each harvest (and snapshot) in ts
+    // order, so viewers need not sort them on load: each thread's events
+    // are sorted (a scope before the scopes nested in it, which were
+    // recorded first) and the threads merged.  Events are only ordered
+    // within a harvest: a long scope is harvested after it ends so it comes
+    // after shorter ones which started later.  Sorting costs harvest time
+    // and RAW batches get a range for each run of one thread's events.
+    void set_sorted_export(bool enabled) { _sorted_export = enabled; }
+    bool has_sorted_export() const { return _sorted_export.load(std::memory_order_relaxed); }
 
 private:
+    // xorshift64* on per-thread state, seeded on first use
+    static uint64_t next_random() {
+        thread_local uint64_t state = 0;
+        if (state == 0) {
+            state = Clock::counter_ticks() ^ reinterpret_cast<uintptr_t>(&state);
+            state |= 1;
+        }
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    // scopes (recorded Contexts) open on this thread, stamped on each event
+    // so export can keep scopes nested (see export_times())
+    static uint32_t& scope_depth() {
+        thread_local uint32_t depth = 0;
+        return depth;
+    }
+
+    // max args per event
+    static constexpr uint32_t MAX_EVENT_ARGS = 255;
+
+    // Event_chunk is a fixed-size block of events written by one thread and
+    // read by the harvester.  The producer publishes each new event (and its
+    // args and text) by advancing num_events.  Once a chunk is full (of
+    // events, args or text) the producer never touches it again: it links a
+    // fresh chunk via next and moves on.
+    struct Event_chunk {
+        static constexpr uint32_t CAPACITY = 512;
+        static constexpr uint32_t ARGS_CAPACITY = 512;
+        static constexpr uint32_t TEXT_CAPACITY = 16 * 1024;
+        Event events[CAPACITY];
+        Arg args[ARGS_CAPACITY];
+        char text[TEXT_CAPACITY];
+        std::atomic<uint32_t> num_events { 0 };
+        std::atomic<Event_chunk*> next { nullptr };
+
+        // flight recorder only: sequence number of the chunk's current use,
+        // bumped before it is overwritten (0 = never used)
+        std::atomic<uint64_t> generation { 0 };
+    };
+
+    // Export_time is the per-thread state for converting ticks to exported
+    // timestamps (see export_times()).  Times are kept per scope depth, up
+    // to MAX_DEPTH (deeper events share the last one), and NONE marks a
+    // depth with nothing exported yet.
+    struct Export_time {
+        static constexpr uint32_t MAX_DEPTH = 64;
+        static constexpr uint64_t NONE = UINT64_MAX;
+        // latest time exported at each depth and the scopes open after it
+        uint64_t last[MAX_DEPTH];
+        uint32_t last_open[MAX_DEPTH];
+        // earliest time exported at each depth or deeper since the latest
+        // one at a shallower depth
+        uint64_t first[MAX_DEPTH];
+        uint32_t num_depths { 0 };
+        // latest time exported at any depth and the scopes open after it
+        uint64_t end { NONE };
+        uint32_t end_open { 0 };
+    };
+
+    // Thread_buffer is a single-producer single-consumer list of chunks:
+    // its thread appends to tail without locking and the harvester drains
+    // from head under _buffers_mutex.  Drained chunks go back to the
+    // producer through free_chunks (a stack only the harvester pushes and
+    // only the producer empties, all at once), about as many as it used in
+    // the last harvest interval, so steady tracing doesn't allocate.
+    //
+    // In flight recorder mode the chunks are instead a fixed ring which the
+    // producer overwrites in turn and which the harvester only ever copies,
+    // validating each copy against the chunk's generation (seqlock style).
+    struct Thread_buffer {
+        Thread_buffer(uint32_t ring_size, String_id tid_str);
+        ~Thread_buffer();
+
+        Event_chunk* head; // harvester only
+        uint32_t read_index { 0 }; // harvester only
+        Event_chunk* tail; // producer only
+        uint32_t write_index { 0 }; // producer only
+        uint32_t num_args { 0 }; // producer only
+        uint32_t text_size { 0 }; // producer only
+        String_id tid; // interned so the harvester caches its text
+        std::atomic<bool> exited { false };
+        Export_time export_time; // harvester only
+
+        std::atomic<Event_chunk*> free_chunks { nullptr }; // linked by next
+        uint32_t num_free_chunks { 0 }; // harvester only: pushed since last seen empty
+        uint32_t num_drained_chunks { 0 }; // harvester only: in the last harvest
+        Event_chunk* spare_chunks { nullptr }; // producer only: taken from free_chunks
+
+        std::vector<Event_chunk*> ring; // flight recorder only
+        uint32_t ring_index { 0 }; // producer only
+        uint64_t generation { 1 }; // producer only
+    };
+
+    // Harvest holds events collected from all Thread_buffers:
+    // events for each thread are contiguous and ranges marks where each ends
+    // (unless sorted export merged them: then a thread may have many runs)
+    struct Harvest {
+        void clear() {
+            events.clear();
+            args.clear();
+            text.clear();
+            ranges.clear();
+        }
+
+        uint64_t ts_units_per_second { USEC_PER_SECOND };
+        std::vector<Event> events;
+        std::vector<Arg> args;
+        std::string text;
+        std::vector<Thread_range> ranges;
+    };
+
+    // Thread_record is a thread's registration, made once on its first event
+    // or metadata.  Its name and sort index are kept here (not in
+    // _meta_events) so they can be sent to consumers as they change and be
+    // dropped a while after the thread exits.
+    struct Thread_record {
+        uint32_t tid; // sequential
+        String_id tid_str; // interned decimal tid
+        std::string name_event; // thread_name meta event (or empty)
+        std::string sort_index_event; // thread_sort_index meta event (or empty)
+        uint64_t version { 0 }; // _thread_meta_version at its last change
+        std::atomic<bool> exited { false };
+    };
+
+    Thread_record& get_thread_record();
+    void set_meta_event(const std::string& key, const std::string& event);
+    void set_clock_sync_event();
+    uint64_t get_thread_meta_events(uint64_t since_version, std::vector<std::string>& meta_events) const;
+    void send_thread_meta_events(const std::vector<Consumer*>& consumers);
+    void remove_exited_thread_records();
+    Thread_buffer& get_thread_buffer();
+    void push_event(
+            String_id name,
+            String_id cat,
+            Phase ph,
+            uint64_t ts,
+            uint64_t dur,
+            const Arg* args,
+            uint32_t num_args,
+            const std::string* json);
+    void next_chunk(Thread_buffer& buffer);
+    void recycle_chunk(Thread_buffer& buffer, Event_chunk* chunk, uint32_t max_free_chunks);
+    void harvest_events(Harvest& harvest);
+    void copy_flight_recorder(Harvest& harvest, uint64_t since);
+    void sort_events(Harvest& harvest);
+    void export_times(Event* events, size_t num_events, Export_time& state, bool nsec) const;
+    void update_strings();
+    void serialize_events(const Harvest& harvest, std::string& json, std::vector<size_t>& ends);
+    void serialize_range(const Harvest& harvest, size_t begin, size_t end,
+            std::string& json, std::vector<size_t>& ends) const;
+    void serialize_slices(std::unique_lock<std::mutex>& lock);
+    void run_serializer(uint64_t generation);
+    void stop_serializer_threads();
+    // Harvest_data is one harvest and its serialization, shared by the
+    // batches made from it
+    struct Harvest_data {
+        Harvest harvest;
+        std::string json;
+        std::vector<size_t> ends;
+        std::shared_ptr<const std::vector<std::string>> strings;
+    };
+    std::shared_ptr<Harvest_data> get_harvest_data();
+    Batch make_batch(const std::shared_ptr<Harvest_data>& data) const;
+    Raw_batch make_raw_batch(const std::shared_ptr<Harvest_data>& data) const;
+    void take_snapshot(Consumer* consumer, uint64_t window);
+    void harvest();
+    void run_harvester(uint64_t interval, uint64_t sample_interval);
+    void update_enabled();
+    void update_stats(std::chrono::steady_clock::time_point harvest_start,
+            size_t num_events, bool discarded, size_t num_bytes);
+    std::string get_stats_meta_event() const;
+
     static std::unique_ptr<Tracer> _instance;
-    mutable std::mutex _event_mutex;
+    mutable std::mutex _meta_mutex;
+    mutable std::mutex _strings_mutex;
+    mutable std::mutex _buffers_mutex;
     mutable std::mutex _consumer_mutex;
-    std::chrono::high_resolution_clock::time_point _start_time;
+    std::mutex _harvest_mutex;
+    Clock _clock;
+    uint32_t _pid;
+    std::string _pid_str;
+    std::string _clock_sync_event;
 
-    // Note: Event does not store 'pid' because we assume
-    // all events are for the same process.
-    struct Event {
-        std::string name;
-        std::string cat;
-        uint64_t ts;
-        uint64_t dur;
-        std::thread::id tid;
-        int32_t args_index;
-        Phase ph;
+    std::vector<Consumer*> _consumers;
+    std::vector<Thread_buffer*> _buffers;
+
+    std::vector<std::string> _meta_events; // process metadata
+
+    // thread metadata: under _meta_mutex
+    std::vector<Thread_record*> _thread_records;
+    uint64_t _thread_meta_version { 0 };
+    uint32_t _next_tid { 1 };
+
+    // interned strings: _strings is shared (under _strings_mutex)
+    // while _harvest_strings is the harvester's private copy and
+    // _harvest_json_strings the same again but JSON-escaped
+    std::unordered_map<std::string, String_id> _string_ids;
+    std::vector<std::string> _strings;
+    std::shared_ptr<std::vector<std::string>> _harvest_strings { std::make_shared<std::vector<std::string>>() }; // copy on write
+    std::vector<std::string> _harvest_json_strings;
+
+    mutable std::mutex _stats_mutex;
+    Stats _stats; // under _stats_mutex, except args_dropped and chunks_allocated
+    std::atomic<uint64_t> _args_dropped { 0 };
+    std::atomic<uint64_t> _chunks_allocated { 0 };
+
+    // recent harvests, reused (with their capacity) once no batch holds
+    // them, and the harvester's scratch lists (under _harvest_mutex)
+    std::vector<std::shared_ptr<Harvest_data>> _harvest_data;
+    std::vector<Consumer*> _harvest_consumers;
+    std::vector<Consumer*> _expired_consumers;
+
+    // sorted export scratch (under _harvest_mutex)
+    struct Merge_cursor {
+        size_t next; // in _sort_order
+        size_t end;
+        size_t range;
     };
+    std::vector<size_t> _sort_order;
+    std::vector<Merge_cursor> _merge_cursors;
+    std::vector<Event> _sorted_events;
+    std::vector<Thread_range> _sorted_ranges;
 
-    std::vector<Consumer*> _consumers;
+    static std::atomic<Category_mask> _enabled_categories; // constant initialized
+    std::unordered_map<std::string, uint32_t> _category_bits; // under _strings_mutex
+    std::unordered_map<String_id, Category_mask> _category_masks; // under _strings_mutex
+
+    // sampling: per category bit
+    std::atomic<Category_mask> _sampled_categories { 0 };
+    std::atomic<uint64_t> _sample_thresholds[64];
+    std::unordered_map<std::string, size_t> _meta_event_index; // by key, under _meta_mutex
+    std::atomic<bool> _nanosecond_precision { false };
+    std::atomic<bool> _sorted_export { false };
+
+    // flight recorder
+    uint32_t _ring_size { 0 };
+    // a snapshot request is claimed (IDLE to CLAIMED) before it is filled
+    // in, then published (PENDING) for the next harvest, which sets IDLE
+    enum Snapshot_state : uint8_t {
+        SNAPSHOT_IDLE,
+        SNAPSHOT_CLAIMED,
+        SNAPSHOT_PENDING
+    };
+    std::atomic<uint8_t> _snapshot_state { SNAPSHOT_IDLE };
+    Consumer* _snapshot_consumer { nullptr };
+    uint64_t _snapshot_window { 0 };
+
+    // sampled counters: all series of one counter event
+    struct Sampled_counter {
+        String_id name;
+        String_id cat;
+        std::vector<String_id> series;
+        std::vector<Counter_sampler> samplers;
+    };
+    std::mutex _samplers_mutex;
+    std::vector<Sampled_counter> _sampled_counters; // under _samplers_mutex
+    std::vector<Arg> _sample_args; // under _samplers_mutex
 
-    std::vector<Event> _events;
-    std::vector<std::string> _meta_events;
-    std::vector<std::string> _args;
-    std::atomic<bool> _enabled { false };
-    mutable uint64_t _last_t { 0 };
+    // harvester thread
+    std::thread _harvester;
+    std::mutex _harvester_mutex;
+    std::condition_variable _harvester_condition;
+    bool _harvester_stop { false };
+    std::atomic<bool> _harvester_running { false };
+
+    // parallel serialization: each slice of the events is serialized into
+    // its own buffers (reused) by whichever thread claims it
+    struct Serializer_slice {
+        size_t begin;
+        size_t end;
+        std::string json;
+        std::vector<size_t> ends;
+    };
+    std::mutex _serializer_mutex;
+    std::condition_variable _serializer_start;
+    std::condition_variable _serializer_done;
+    std::vector<std::thread> _serializer_threads;
+    std::vector<Serializer_slice> _serializer_slices; // under _serializer_mutex
+    const Harvest* _serializer_harvest { nullptr }; // under _serializer_mutex
+    size_t _serializer_next_slice { 0 }; // under _serializer_mutex
+    size_t _serializer_pending { 0 }; // under _serializer_mutex
+    uint64_t _serializer_generation { 0 }; // under _serializer_mutex
+    size_t _serializer_min_events { 0 };
+    bool _serializer_stop { false }; // under _serializer_mutex
+
+    friend class Context;
 
     Tracer(Tracer const&); // Don't Implement
     void operator=(Tracer const&); // Don't implement
 };
 
+// Call_site holds the interned name and category of one trace macro.
+// The macros declare it function-local static so interning happens
+// once per call site rather than once per event.
+class Call_site {
+public:
+    // Note: only string literals are accepted because the strings are
+    // interned once and then assumed constant for the life of the process.
+    template <size_t N, size_t M>
+    Call_site(const char (&name_str)[N], const char (&cat_str)[M])
+        : name(Tracer::instance().intern(name_str)), cat(Tracer::instance().intern(cat_str)),
+        categories(Tracer::instance().get_category_mask(cat)) { }
+
+    const String_id name;
+    const String_id cat;
+    const Category_mask categories;
+};
+
+// Arg_key holds the interned key of one TRACE_CONTEXT_ARG call site
+class Arg_key {
+public:
+    template <size_t N>
+    Arg_key(const char (&key_str)[N]) : id(Tracer::instance().intern(key_str)) { }
+
+    const String_id id;
+};
+
 // Context measures timestamp in ctor
 // and creates a Phase::Complete event in dtor
+//
+// Note: when constructed from a Call_site, a String_id, or string literals
+// Context does no heap allocation between ctor and dtor (unless args are
+// added), and when tracing is disabled at construction it does nothing.
+// From a Call_site "nothing" is one relaxed load and an untaken branch.
 class Context {
 public:
+    Context(const Call_site& site) : _name(site.name), _cat(site.cat)
+    {
+        if (TEF_UNLIKELY(Tracer::is_enabled(site.categories))
+                && Tracer::instance().is_sampled(site.categories)) {
+            start();
+        }
+    }
+
+    Context(String_id name, String_id cat) : _name(name), _cat(cat)
+    {
+        if (TEF_UNLIKELY(Tracer::is_enabled())) {
+            Tracer& tracer = Tracer::instance();
+            if (tracer.is_category_enabled(cat) && tracer.is_sampled(tracer.get_category_mask(cat))) {
+                start();
+            }
+        }
+    }
+
+    template <size_t N, size_t M>
+    Context(const char (&name)[N], const char (&cat)[M])
+    {
+        if (TEF_UNLIKELY(Tracer::is_enabled())) {
+            Tracer& tracer = Tracer::instance();
+            _cat = tracer.intern_literal(cat);
+            if (tracer.is_category_enabled(_cat) && tracer.is_sampled(tracer.get_category_mask(_cat))) {
+                _name = tracer.intern_literal(name);
+                start();
+            }
+        }
+    }
+
+    // Note: this interns name and cat on every call
     Context(const std::string& name, const std::string& cat)
-        : _name(name), _cat(cat)
     {
-        _ts= Tracer::instance().now();
+        if (TEF_UNLIKELY(Tracer::is_enabled())) {
+            Tracer& tracer = Tracer::instance();
+            _cat = tracer.intern(cat);
+            if (tracer.is_category_enabled(_cat) && tracer.is_sampled(tracer.get_category_mask(_cat))) {
+                _name = tracer.intern(name);
+                start();
+            }
+        }
     }
 
-    void add_args(const std::string& args)
+    // typed args are captured raw and only formatted at harvest
+    // Note: args beyond MAX_ARGS are dropped
+    template <typename T>
+    void add_arg(String_id key, T value)
     {
-        // args = ""\"key\":value,..."
-        if (!_args.empty())
+        if (_active && _num_args < MAX_ARGS)
         {
-            _args.append(",");
+            _typed_args[_num_args++] = make_arg(key, value);
         }
-        _args.append(args);
     }
 
-    ~Context() {
-        if (_args.empty())
+    // legacy pre-formatted args
+    void add_args(const std::string& args)
+    {
+        // args = ""\"key\":value,..."
+        if (!_args)
         {
-            Tracer::instance().add_event(_name, _cat, Phase::Complete, _ts, Tracer::instance().now() - _ts);
+            _args.reset(new std::string(args));
         }
         else
         {
-#ifdef NO_FMT
-            std::string args = "{";
-            args.append(_args);
-            args.append("}");
-            Tracer::instance().add_event_with_args(_name, _cat, Phase::Complete, args, _ts, Tracer::instance().now() - _ts);
-#else
-            Tracer::instance().add_event_with_args(_name, _cat, Phase::Complete, fmt::format("{{{}}}", _args), _ts, Tracer::instance().now() - _ts);
-#endif // NO_FMT
+            _args->append(",");
+            _args->append(args);
+        }
+    }
+
+    ~Context() {
+        if (TEF_UNLIKELY(_active))
+        {
+            --Tracer::scope_depth();
+            if (Tracer::is_enabled())
+            {
+                Tracer& tracer = Tracer::instance();
+                tracer.push_event(_name, _cat, Phase::Complete, _ts, tracer.now() - _ts,
+                        _typed_args, _num_args, _args && !_args->empty() ? _args.get() : nullptr);
+            }
         }
     }
+
+    static constexpr uint32_t MAX_ARGS = 8;
+    static constexpr bool IS_COMPILED = true;
+    typedef Arg_key Key;
+
 private:
-    std::string _name;
-    std::string _cat;
-    std::string _args;
-    uint64_t _ts;
+    // Note: call start() only when our category is enabled
+    void start() {
+        _active = true;
+        ++Tracer::scope_depth();
+        _ts = Tracer::instance().now();
+    }
+
+    String_id _name { 0 };
+    String_id _cat { 0 };
+    std::unique_ptr<std::string> _args; // only legacy args allocate
+    uint64_t _ts { 0 };
+    Arg _typed_args[MAX_ARGS];
+    uint32_t _num_args { 0 };
+    bool _active { false };
+};
+
+// Compile-time category and level filter: is_compiled() is true when a
+// site with category cat (comma separated, like at runtime) and level is
+// compiled in, given the categories (empty is all) and min_level to keep.
+// Names are compared as the runtime filter does, ignoring spaces at either
+// end.  The macros pass TEF_COMPILED_CATEGORIES and TEF_MIN_LEVEL.
+constexpr bool is_category_end(const char* s) {
+    return *s == '\0' || *s == ',' || (*s == ' ' && is_category_end(s + 1));
+}
+
+constexpr const char* skip_spaces(const char* s) {
+    return *s == ' ' ? skip_spaces(s + 1) : s;
+}
+
+constexpr const char* next_category(const char* s) {
+    return *s == '\0' ? s : (*s == ',' ? skip_spaces(s + 1) : next_category(s + 1));
+}
+
+constexpr bool is_same_category(const char* a, const char* b) {
+    return is_category_end(a) ? is_category_end(b)
+        : (*a == *b && is_same_category(a + 1, b + 1));
+}
+
+// is category cat in the comma separated list?
+constexpr bool is_listed_category(const char* list, const char* cat) {
+    return is_same_category(list, cat)
+        || (*next_category(list) != '\0' && is_listed_category(next_category(list), cat));
+}
+
+// is any category of cat in the list?
+constexpr bool has_listed_category(const char* list, const char* cat) {
+    return is_listed_category(skip_spaces(list), cat)
+        || (*next_category(cat) != '\0' && has_listed_category(list, next_category(cat)));
+}
+
+constexpr bool is_compiled(const char* cat, int level, const char* categories, int min_level) {
+    return level >= min_level
+        && (*skip_spaces(categories) == '\0' || has_listed_category(categories, skip_spaces(cat)));
+}
+
+// stand-ins for Call_site, Arg_key and Context at compiled out sites:
+// constant initialized and empty so the site generates no code
+class Compiled_out_site {
+public:
+    template <size_t N, size_t M>
+    constexpr Compiled_out_site(const char (&)[N], const char (&)[M]) { }
+};
+
+class Compiled_out_key {
+public:
+    template <size_t N>
+    constexpr Compiled_out_key(const char (&)[N]) { }
+
+    const String_id id { 0 };
+};
+
+class Compiled_out_context {
+public:
+    explicit Compiled_out_context(const Compiled_out_site&) { }
+
+    template <typename T>
+    void add_arg(String_id, T) { }
+    void add_args(const std::string&) { }
+
+    static constexpr bool IS_COMPILED = false;
+    typedef Compiled_out_key Key;
+};
+
+// Compiled_site<is_compiled(...)> picks the types of a trace macro
+template <bool compiled>
+struct Compiled_site {
+    static constexpr bool IS_COMPILED = true;
+    typedef Call_site Site;
+    typedef Context Scope;
+};
+
+template <>
+struct Compiled_site<false> {
+    static constexpr bool IS_COMPILED = false;
+    typedef Compiled_out_site Site;
+    typedef Compiled_out_context Scope;
+};
+
+// Queued_consumer runs another consumer on a thread of its own so that a
+// slow one (e.g. writing to the network) never holds up the harvest or the
+// other consumers.  Batches are queued by reference (see Batch_owner), not
+// copied.  Once max_batches are waiting it either drops new batches
+// (counted by get_num_dropped()) or, with BLOCK, makes the harvest wait.
+// Add the Queued_consumer to the Tracer in place of the consumer it wraps,
+// which it finishes on its thread: it is COMPLETE after that one is.
+// Deleting it early (after remove_consumer()) consumes what was queued and
+// finishes the wrapped consumer, without process metadata.
+class Queued_consumer : public Tracer::Consumer {
+public:
+    enum Policy : uint8_t {
+        DROP,
+        BLOCK
+    };
+
+    Queued_consumer(Tracer::Consumer* consumer, size_t max_batches = 64, Policy policy = DROP);
+    ~Queued_consumer();
+    void consume_batch(const Tracer::Batch& batch) final override;
+    void consume_raw(const Tracer::Raw_batch& batch) final override;
+    void consume_meta_events(const std::vector<std::string>& meta_events) final override;
+    void finish(const std::vector<std::string>& meta_events) final override;
+    uint64_t get_num_dropped() const { return _num_dropped.load(); } // events
+private:
+    struct Item {
+        enum Type : uint8_t {
+            BATCH,
+            RAW_BATCH,
+            META_EVENTS,
+            FINISH
+        };
+        Type type;
+        Tracer::Batch batch;
+        Tracer::Raw_batch raw_batch;
+        std::vector<std::string> meta_events;
+    };
+
+    void push(Item&& item, bool droppable, size_t num_events);
+    void run();
+
+    Tracer::Consumer* _consumer;
+    size_t _max_batches;
+    Policy _policy;
+    std::atomic<uint64_t> _num_dropped { 0 };
+    std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+    std::deque<Item> _queue; // under _mutex
+    bool _stop { false }; // under _mutex
+    std::thread _thread;
 };
 
 // Trace_to_file is a simple consumer for saving events to file
 class Trace_to_file : public Tracer::Consumer {
 public:
     Trace_to_file(uint64_t lifetime, const std::string& filename);
+    void consume_batch(const Tracer::Batch& batch) final override;
     void consume_events(const std::vector<std::string>& events) final override;
     void finish(const std::vector<std::string>& meta_events) final override;
     bool is_open() const { return _stream.is_open(); }
@@ -290,6 +1335,313 @@ private:
     std::ofstream _stream;
 };
 
+#ifdef TEF_USE_ZLIB
+// Trace_to_gzip is like Trace_to_file but streams the events through zlib
+// as they are consumed (on the harvest path, not on producer threads).
+// chrome://tracing and Perfetto both load .json.gz files directly.
+// level is the zlib compression level: 1 (fastest) to 9 (smallest).
+class Trace_to_gzip : public Tracer::Consumer {
+public:
+    Trace_to_gzip(uint64_t lifetime, const std::string& filename, int level = 1);
+    ~Trace_to_gzip();
+    void consume_batch(const Tracer::Batch& batch) final override;
+    void consume_events(const std::vector<std::string>& events) final override;
+    void finish(const std::vector<std::string>& meta_events) final override;
+    bool is_open() const { return _stream != nullptr; }
+    const std::string& get_filename() const { return _file; }
+private:
+    void write(const char* data, size_t size);
+    std::string _file;
+    gzFile _stream { nullptr };
+};
+#endif // TEF_USE_ZLIB
+
+#ifndef _WIN32
+// Trace_to_mmap is like Trace_to_file but copies events straight into a
+// shared mapping of the file, which is grown in preallocated extents of
+// extent_size bytes.  The data belongs to the page cache as soon as it is
+// copied so it survives a crash of the process (though not of the machine)
+// and recover_json_trace() turns such a truncated file into a loadable
+// trace.  POSIX only.
+class Trace_to_mmap : public Tracer::Consumer {
+public:
+    Trace_to_mmap(uint64_t lifetime, const std::string& filename, size_t extent_size = 64 << 20);
+    ~Trace_to_mmap();
+    void consume_batch(const Tracer::Batch& batch) final override;
+    void consume_events(const std::vector<std::string>& events) final override;
+    void finish(const std::vector<std::string>& meta_events) final override;
+    bool is_open() const { return _fd != -1; }
+    const std::string& get_filename() const { return _file; }
+private:
+    bool reserve(size_t size);
+    void write(const char* data, size_t size);
+    void close();
+    std::string _file;
+    int _fd { -1 };
+    char* _map { nullptr };
+    size_t _mapped { 0 }; // file size: a multiple of _extent_size
+    size_t _size { 0 }; // bytes written
+    size_t _extent_size;
+};
+#endif // _WIN32
+
+// Binary_encoder writes the binary trace format (described in trace.cpp)
+// for Trace_to_binary, Trace_to_socket and Trace_to_shared_memory.  Strings
+// are written once, the first time a batch includes them, and timestamps as
+// deltas.
+class Binary_encoder {
+public:
+    explicit Binary_encoder(uint64_t ts_units_per_second);
+    uint64_t get_ts_units_per_second() const { return _ts_units_per_second; }
+    void append_header(std::string& out) const;
+    // strings the batch added (always needed, even if its events are not)
+    void append_strings(const Tracer::Raw_batch& batch, std::string& out);
+    void append_events(const Tracer::Raw_batch& batch, std::string& out);
+    void append_meta_events(const std::vector<std::string>& meta_events, std::string& out) const;
+    void append_end(std::string& out) const;
+private:
+    size_t _num_strings { 0 };
+    uint64_t _ts_units_per_second;
+    std::unordered_map<String_id, uint64_t> _last_ts; // per thread
+};
+
+// Trace_to_binary is a consumer for saving events in a compact binary
+// format (described in trace.cpp) which is far cheaper to write than JSON.
+// Use convert_binary_trace() (or the tef_convert tool) to turn it into
+// TEF JSON offline.  Since chrome://tracing never loads the binary file
+// directly its lifetime is not capped.
+class Trace_to_binary : public Tracer::Consumer {
+public:
+    Trace_to_binary(uint64_t lifetime, const std::string& filename);
+    void consume_raw(const Tracer::Raw_batch& batch) final override;
+    void consume_meta_events(const std::vector<std::string>& meta_events) final override;
+    void finish(const std::vector<std::string>& meta_events) final override;
+    bool is_open() const { return _stream.is_open(); }
+    const std::string& get_filename() const { return _file; }
+private:
+    std::string _file;
+    std::ofstream _stream;
+    std::string _buffer;
+    Binary_encoder _encoder;
+};
+
+#ifndef _WIN32
+// Trace_to_socket streams events live to a collector (e.g. tools/tef_collect)
+// over TCP ("host:port") or a Unix domain socket ("unix:path").
+// As a RAW consumer it sends the binary format and its lifetime is not
+// capped; as a JSON consumer it sends the TEF JSON batches themselves, which
+// are queued by reference (see Batch_owner) rather than copied.  The socket
+// is nonblocking and only written when the harvest hands over data; once
+// max_buffered bytes are waiting for it new batches are dropped whole
+// (counted by get_num_dropped()).  finish() waits up to finish_timeout msec
+// for the rest to be sent.  POSIX only.
+class Trace_to_socket : public Tracer::Consumer {
+public:
+    Trace_to_socket(uint64_t lifetime, const std::string& address, Format format = RAW,
+            size_t max_buffered = 64 << 20, uint64_t finish_timeout = 1000);
+    ~Trace_to_socket();
+    void consume_batch(const Tracer::Batch& batch) final override;
+    void consume_events(const std::vector<std::string>& events) final override;
+    void consume_raw(const Tracer::Raw_batch& batch) final override;
+    void consume_meta_events(const std::vector<std::string>& meta_events) final override;
+    void finish(const std::vector<std::string>& meta_events) final override;
+    bool is_open() const { return _fd != -1; }
+    const std::string& get_address() const { return _address; }
+    uint64_t get_num_dropped() const { return _num_dropped; } // events
+private:
+    // a serialized buffer waiting for the socket: either data of a batch
+    // kept alive by owner or bytes of our own
+    struct Chunk {
+        Tracer::Batch_owner owner;
+        const char* data { nullptr };
+        size_t size { 0 };
+        std::string bytes;
+        const char* begin() const { return owner ? data : bytes.data(); }
+    };
+
+    bool connect();
+    void push(Chunk&& chunk);
+    void push(std::string&& bytes);
+    bool has_room() const { return _queued_bytes < _max_buffered; }
+    bool flush(int timeout_msec);
+    void close();
+
+    std::string _address;
+    int _fd { -1 };
+    bool _connecting { false };
+    Binary_encoder _encoder;
+    std::deque<Chunk> _queue;
+    size_t _offset { 0 }; // bytes of _queue.front() already sent
+    size_t _queued_bytes { 0 };
+    size_t _max_buffered;
+    uint64_t _finish_timeout;
+    uint64_t _num_dropped { 0 };
+};
+
+// Trace_segment is the layout of the shared memory segment which
+// Shared_memory_collector creates and Trace_to_shared_memory writes to
+// (described in trace.cpp)
+struct Trace_segment;
+struct Trace_segment_slot;
+
+// Trace_to_shared_memory hands events to a collector process through
+// shared memory instead of formatting JSON and writing a file itself: it
+// claims a slot of the segment name (e.g. "/myapp-trace") which a
+// Shared_memory_collector (e.g. tools/tef_collect shm:/myapp-trace) created,
+// and streams the binary format into the slot's ring.  Any number of
+// processes can write to one segment, up to its number of slots.  Once
+// max_buffered bytes are waiting for room in the ring new batches are
+// dropped whole (counted by get_num_dropped()).  finish() waits up to
+// finish_timeout msec for room in the ring for the rest.  POSIX only.
+class Trace_to_shared_memory : public Tracer::Consumer {
+public:
+    Trace_to_shared_memory(uint64_t lifetime, const std::string& name,
+            size_t max_buffered = 64 << 20, uint64_t finish_timeout = 1000);
+    ~Trace_to_shared_memory();
+    void consume_raw(const Tracer::Raw_batch& batch) final override;
+    void consume_meta_events(const std::vector<std::string>& meta_events) final override;
+    void finish(const std::vector<std::string>& meta_events) final override;
+    bool is_open() const { return _slot != nullptr; }
+    const std::string& get_name() const { return _name; }
+    uint64_t get_num_dropped() const { return _num_dropped; } // events
+private:
+    bool has_room() const { return _pending.size() - _offset < _max_buffered; }
+    bool flush(uint64_t timeout_msec);
+    void close();
+
+    std::string _name;
+    Trace_segment* _segment { nullptr };
+    size_t _segment_size { 0 };
+    Trace_segment_slot* _slot { nullptr };
+    char* _ring { nullptr };
+    uint64_t _ring_size { 0 };
+    Binary_encoder _encoder;
+    std::string _pending; // bytes waiting for room in the ring
+    size_t _offset { 0 }; // bytes of _pending already in the ring
+    size_t _max_buffered;
+    uint64_t _finish_timeout;
+    uint64_t _num_dropped { 0 };
+};
+
+// Shared_memory_collector creates the shared memory segment name with
+// num_slots slots of slot_size bytes and serializes what the
+// Trace_to_shared_memory consumers of other processes write there into one
+// TEF JSON trace on out.  Each process is shown under its own pid and its
+// timestamps are moved onto the collector's timeline (ts 0 is when the
+// collector was created) using the steady_clock time each stream starts
+// with, which is also written as a clock_sync event.  Call poll()
+// regularly: it does not block.  A process which exits without finishing
+// its trace keeps what it wrote.  POSIX only.
+class Shared_memory_collector {
+public:
+    Shared_memory_collector(const std::string& name, std::ostream& out,
+            uint32_t num_slots = 16, size_t slot_size = 4 << 20);
+    ~Shared_memory_collector();
+    bool is_open() const { return _segment != nullptr; }
+    const std::string& get_name() const { return _name; }
+
+    // poll() serializes what was written since the last call and returns
+    // the number of bytes read
+    size_t poll();
+
+    uint32_t get_num_attached() const { return _num_attached; } // writing now
+    uint32_t get_num_finished() const { return _num_finished; } // done (or gone)
+
+    // finish() reads what is left, closes the trace and removes the segment
+    void finish();
+private:
+    struct Stream;
+    void decode(Stream& stream, std::string& json);
+
+    std::string _name;
+    std::ostream& _out;
+    Trace_segment* _segment { nullptr };
+    size_t _segment_size { 0 };
+    std::vector<std::unique_ptr<Stream>> _streams; // per slot
+    uint64_t _timeline_nsec;
+    bool _first { true };
+    uint32_t _num_attached { 0 };
+    uint32_t _num_finished { 0 };
+};
+#endif // _WIN32
+
+// Latency_histogram counts values in log-linear buckets (HDR style):
+// exact below 2^SUB_BUCKET_BITS and within 1/2^SUB_BUCKET_BITS (~6%) above
+class Latency_histogram {
+public:
+    static constexpr uint32_t SUB_BUCKET_BITS = 4;
+    static constexpr uint32_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static constexpr uint32_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    void record(uint64_t value);
+
+    // value at percentile (0 to 100), which is the highest value of its
+    // bucket (clamped to max) so it is never under-reported
+    uint64_t get_percentile(double percentile) const;
+
+    uint64_t get_count() const { return _count; }
+    uint64_t get_min() const { return _count > 0 ? _min : 0; }
+    uint64_t get_max() const { return _max; }
+    double get_mean() const { return _count > 0 ? (double)(_sum) / (double)(_count) : 0.0; }
+
+    // lowest and highest values counted in bucket index
+    static uint64_t get_bucket_low(uint32_t index);
+    static uint64_t get_bucket_high(uint32_t index);
+    static uint32_t get_bucket_index(uint64_t value);
+    uint64_t get_bucket_count(uint32_t index) const { return _buckets[index]; }
+
+private:
+    uint64_t _count { 0 };
+    uint64_t _min { UINT64_MAX };
+    uint64_t _max { 0 };
+    uint64_t _sum { 0 };
+    uint64_t _buckets[NUM_BUCKETS] = {};
+};
+
+// Trace_to_histograms is a RAW consumer that folds the dur of Complete
+// events (e.g. TRACE_CONTEXT scopes) into a Latency_histogram in nsec per
+// name, category and thread.  It never formats a string so it is cheap
+// enough to leave running.  Read the histograms with get_snapshot() and
+// turn the ids into text with Tracer::get_string().
+class Trace_to_histograms : public Tracer::Consumer {
+public:
+    struct Entry {
+        String_id name;
+        String_id cat;
+        String_id tid;
+        Latency_histogram histogram;
+    };
+
+    Trace_to_histograms(uint64_t lifetime = DISTANT_FUTURE) : Tracer::Consumer(lifetime, Tracer::Consumer::RAW) { }
+    void consume_raw(const Tracer::Raw_batch& batch) final override;
+
+    // copy of all histograms, optionally resetting them afterwards
+    std::vector<Entry> get_snapshot(bool reset = false);
+
+private:
+    struct Key_hash {
+        size_t operator()(uint64_t key) const { return (size_t)(key ^ (key >> 29)); }
+    };
+    Entry& get_entry(String_id name, String_id cat, String_id tid);
+
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<Entry>> _entries;
+    // (name, cat) key per thread
+    std::unordered_map<String_id, std::unordered_map<uint64_t, Entry*, Key_hash>> _index;
+};
+
+// convert_binary_trace() reads a Trace_to_binary file and writes TEF JSON.
+// Returns false if the input is not a (complete) binary trace, in which
+// case out holds whatever could be converted.
+bool convert_binary_trace(std::istream& in, std::ostream& out);
+
+// recover_json_trace() copies a JSON trace which was never finished (for
+// example the file of a Trace_to_mmap whose process crashed) to out,
+// dropping the zero padding and any partly written event and closing the
+// traceEvents array.  Complete traces are copied unchanged.  Returns false
+// if in is not a JSON trace.
+bool recover_json_trace(std::istream& in, std::ostream& out);
+
 } // namespace tef
 
 #ifdef USE_TEF
@@ -300,21 +1652,49 @@ private:
     // use this inside mainloop
     #define TRACE_MAINLOOP ::tef::Tracer::instance().advance_consumers(); if(g_trace_consumer && g_trace_consumer->is_complete()) g_trace_consumer.reset();
 
+    // use this before mainloop to harvest on a Tracer thread every interval msec
+    #define TRACE_HARVESTER(interval) ::tef::Tracer::instance().start_harvester(interval);
+
+    // use this to record only about 1 in rate scopes of the comma separated categories
+    #define TRACE_SAMPLING(categories, rate) ::tef::Tracer::instance().set_sampling(categories, rate);
+
     // use this after mainloop, before exit
     #define TRACE_SHUTDOWN ::tef::Tracer::instance().shutdown(); if (g_trace_consumer) g_trace_consumer.reset();
 
     // use these to add meta_events
     #define TRACE_PROCESS(name) ::tef::Tracer::instance().add_meta_event("process_name", name);
+    #define TRACE_PROCESS_LABELS(labels) ::tef::Tracer::instance().add_meta_event("process_labels", labels);
+    #define TRACE_PROCESS_SORT(index) ::tef::Tracer::instance().add_meta_event("process_sort_index", index);
     #define TRACE_THREAD(name) ::tef::Tracer::instance().add_meta_event("thread_name", name);
     #define TRACE_THREAD_SORT(index) ::tef::Tracer::instance().add_meta_event("thread_sort_index", index);
 
+    // use this to record a counter value
+    #define TRACE_COUNTER(name, cat, value) { if (TEF_UNLIKELY(::tef::Tracer::is_enabled())) \
+        ::tef::Tracer::instance().set_counter(name, cat, (int64_t)(value)); }
+
+    // is a site of category cat and level compiled in?
+    #define TEF_IS_COMPILED(cat, level) ::tef::is_compiled(cat, level, TEF_COMPILED_CATEGORIES, TEF_MIN_LEVEL)
+
     // use TRACE_CONTEXT for easy Duration events
-    #define TRACE_CONTEXT(name, cat) ::tef::Context _tef_context_(name, cat);
+    // (name and cat must be string literals: they are interned once per call site)
+    #define TRACE_CONTEXT(name, cat) TRACE_CONTEXT_L(TEF_MIN_LEVEL, name, cat)
+
+    // use TRACE_CONTEXT_L for a span of some level of detail (e.g. 0 for the
+    // finest, higher for coarser ones): it is compiled out when level is
+    // below TEF_MIN_LEVEL, and like TRACE_CONTEXT when cat is not in
+    // TEF_COMPILED_CATEGORIES
+    #define TRACE_CONTEXT_L(level, name, cat) \
+        static const ::tef::Compiled_site<TEF_IS_COMPILED(cat, level)>::Site _tef_site_(name, cat); \
+        ::tef::Compiled_site<TEF_IS_COMPILED(cat, level)>::Scope _tef_context_(_tef_site_);
+
+    // use TRACE_CONTEXT_DYNAMIC when name or cat are built at runtime
+    // (slower: they are interned on every call)
+    #define TRACE_CONTEXT_DYNAMIC(name, cat) ::tef::Context _tef_context_(name, cat);
 
     // where a TRACE_CONTEXT is active: args can be added later
 #ifdef NO_FMT
     // when not using fmt expect single "\"key\":{}" value arguments
-    #define TRACE_CONTEXT_ARGS(key, value) {std::string s = key; \
+    #define TRACE_CONTEXT_ARGS(key, value) { if (decltype(_tef_context_)::IS_COMPILED) {std::string s = key; \
         size_t p = s.find("{}"); \
         if (p != std::string::npos) {\
             s.erase(p, 2); \
@@ -323,15 +1703,45 @@ private:
             else _ss_ << s.substr(0, p) << value << s.substr(p, std::string::npos); \
             _tef_context_.add_args(_ss_.str());\
         }\
-    }
+    } }
 #else
-    #define TRACE_CONTEXT_ARGS(fmt_string, ...) _tef_context_.add_args(fmt::format(fmt_string,__VA_ARGS__));
+    #define TRACE_CONTEXT_ARGS(fmt_string, ...) { if (decltype(_tef_context_)::IS_COMPILED) \
+        _tef_context_.add_args(fmt::format(fmt_string,__VA_ARGS__)); }
 #endif //NO_FMT
 
+    // prefer TRACE_CONTEXT_ARG: value is stored typed (integer, floating point,
+    // bool or interned string) and formatting is deferred to harvest
+    // (key must be a string literal)
+    #define TRACE_CONTEXT_ARG(key, value) { if (decltype(_tef_context_)::IS_COMPILED) { \
+        static const decltype(_tef_context_)::Key _tef_key_(key); \
+        _tef_context_.add_arg(_tef_key_.id, value); } }
+
     // use TRACE_BEGIN/END when you know what you're doing
     // and when TRACE_CONTEXT does not quite do what you need
-    #define TRACE_BEGIN(name, cat) ::tef::Tracer::instance().add_event(name, cat, ::tef::Phase::DurationBegin);
-    #define TRACE_END(name, cat) ::tef::Tracer::instance().add_event(name, cat, ::tef::Phase::DurationEnd);
+    #define TRACE_BEGIN(name_str, cat_str) { if (::tef::Compiled_site<TEF_IS_COMPILED(cat_str, TEF_MIN_LEVEL)>::IS_COMPILED) { \
+        static const ::tef::Call_site _tef_site_(name_str, cat_str); \
+        if (TEF_UNLIKELY(::tef::Tracer::is_enabled(_tef_site_.categories))) \
+            ::tef::Tracer::instance().add_event(_tef_site_.name, _tef_site_.cat, ::tef::Phase::DurationBegin); } }
+    #define TRACE_END(name_str, cat_str) { if (::tef::Compiled_site<TEF_IS_COMPILED(cat_str, TEF_MIN_LEVEL)>::IS_COMPILED) { \
+        static const ::tef::Call_site _tef_site_(name_str, cat_str); \
+        if (TEF_UNLIKELY(::tef::Tracer::is_enabled(_tef_site_.categories))) \
+            ::tef::Tracer::instance().add_event(_tef_site_.name, _tef_site_.cat, ::tef::Phase::DurationEnd); } }
+
+    // use these for async and flow events: those with the same name, cat
+    // and 64-bit id are tied together even when on different threads.
+    // Flow events bind to the enclosing scope (e.g. a TRACE_CONTEXT) on their
+    // thread, so use TRACE_FLOW_BEGIN where work is handed off (e.g. queued)
+    // and TRACE_FLOW_STEP/END inside the scopes which pick it up.
+    #define TRACE_ID_EVENT(name_str, cat_str, ph, id) { if (::tef::Compiled_site<TEF_IS_COMPILED(cat_str, TEF_MIN_LEVEL)>::IS_COMPILED) { \
+        static const ::tef::Call_site _tef_site_(name_str, cat_str); \
+        if (TEF_UNLIKELY(::tef::Tracer::is_enabled(_tef_site_.categories))) \
+            ::tef::Tracer::instance().add_event_with_id(_tef_site_.name, _tef_site_.cat, ph, id); } }
+    #define TRACE_ASYNC_BEGIN(name, cat, id) TRACE_ID_EVENT(name, cat, ::tef::Phase::AsyncNestableStart, id)
+    #define TRACE_ASYNC_INSTANT(name, cat, id) TRACE_ID_EVENT(name, cat, ::tef::Phase::AsyncNestableInstant, id)
+    #define TRACE_ASYNC_END(name, cat, id) TRACE_ID_EVENT(name, cat, ::tef::Phase::AsyncNestableEnd, id)
+    #define TRACE_FLOW_BEGIN(name, cat, id) TRACE_ID_EVENT(name, cat, ::tef::Phase::FlowStart, id)
+    #define TRACE_FLOW_STEP(name, cat, id) TRACE_ID_EVENT(name, cat, ::tef::Phase::FlowStep, id)
+    #define TRACE_FLOW_END(name, cat, id) TRACE_ID_EVENT(name, cat, ::tef::Phase::FlowEnd, id)
 
 #else
     // all macros are no-ops
@@ -346,15 +1756,30 @@ private:
 
     #define TRACE_GLOBAL_INIT int _foo_(){return 0;}
     #define TRACE_MAINLOOP TRACE_NOOP;
+    #define TRACE_HARVESTER(interval) TRACE_NOOP;
+    #define TRACE_SAMPLING(categories, rate) TRACE_NOOP;
     #define TRACE_SHUTDOWN TRACE_NOOP;
 
     #define TRACE_PROCESS(name) TRACE_NOOP;
+    #define TRACE_PROCESS_LABELS(labels) TRACE_NOOP;
+    #define TRACE_PROCESS_SORT(index) TRACE_NOOP;
     #define TRACE_THREAD(name) TRACE_NOOP;
     #define TRACE_THREAD_SORT(index) TRACE_NOOP;
+    #define TRACE_COUNTER(name, cat, value) TRACE_NOOP;
 
     #define TRACE_CONTEXT(name, cat) TRACE_NOOP;
+    #define TRACE_CONTEXT_L(level, name, cat) TRACE_NOOP;
+    #define TRACE_CONTEXT_DYNAMIC(name, cat) TRACE_NOOP;
     #define TRACE_CONTEXT_ARGS(fmt_string, ...) TRACE_NOOP;
+    #define TRACE_CONTEXT_ARG(key, value) TRACE_NOOP;
     #define TRACE_BEGIN(name, cat) TRACE_NOOP;
     #define TRACE_END(name, cat) TRACE_NOOP;
+    #define TRACE_ID_EVENT(name, cat, ph, id) TRACE_NOOP;
+    #define TRACE_ASYNC_BEGIN(name, cat, id) TRACE_NOOP;
+    #define TRACE_ASYNC_INSTANT(name, cat, id) TRACE_NOOP;
+    #define TRACE_ASYNC_END(name, cat, id) TRACE_NOOP;
+    #define TRACE_FLOW_BEGIN(name, cat, id) TRACE_NOOP;
+    #define TRACE_FLOW_STEP(name, cat, id) TRACE_NOOP;
+    #define TRACE_FLOW_END(name, cat, id) TRACE_NOOP;
 
 #endif // USE_TEF
@@ -0,0 +1,213 @@
+// teflib/tools/tef_collect.cpp
+//
+// Collects a trace streamed live by a tef::Trace_to_socket and writes it as
+// TEF JSON which can be loaded into chrome://tracing or
+// https://ui.perfetto.dev.  Listens on a TCP port ([host:]port) or a Unix
+// domain socket (unix:path) and accepts one connection.  Either format of
+// stream is accepted, and if the connection is lost the events received so
+// far are still written as a loadable trace.
+//
+// With shm:name it instead creates the shared memory segment name which
+// tef::Trace_to_shared_memory consumers of any number of processes write
+// to, and collects until every process which attached has finished (or
+// until interrupted).  POSIX only.
+//
+// usage: tef_collect [host:]port out.json
+//        tef_collect unix:path out.json
+//        tef_collect shm:name out.json
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+namespace {
+    // reads the connection through an istream, as received
+    class Socket_buffer : public std::streambuf {
+    public:
+        explicit Socket_buffer(int fd) : _fd(fd) {}
+    protected:
+        int_type underflow() override {
+            ssize_t n;
+            do {
+                n = recv(_fd, _buffer, sizeof(_buffer), 0);
+            } while (n == -1 && errno == EINTR);
+            if (n <= 0) {
+                return traits_type::eof();
+            }
+            setg(_buffer, _buffer, _buffer + n);
+            return traits_type::to_int_type(_buffer[0]);
+        }
+    private:
+        int _fd;
+        char _buffer[1 << 16];
+    };
+
+    int listen_on(const std::string& address) {
+        int fd = -1;
+        if (address.compare(0, 5, "unix:") == 0) {
+            std::string path = address.substr(5);
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+                return -1;
+            }
+            addr.sun_family = AF_UNIX;
+            memcpy(addr.sun_path, path.data(), path.size());
+            unlink(path.c_str()); // left by an earlier run
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd != -1 && bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+                close(fd);
+                return -1;
+            }
+        } else {
+            size_t colon = address.rfind(':');
+            std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+            std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+            if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+                host = host.substr(1, host.size() - 2); // [::1]:port
+            }
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = host.empty() ? AF_INET : AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+            struct addrinfo* info = nullptr;
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info) != 0) {
+                return -1;
+            }
+            fd = socket(info->ai_family, SOCK_STREAM, 0);
+            int on = 1;
+            if (fd != -1 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+                    || bind(fd, info->ai_addr, info->ai_addrlen) != 0)) {
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(info);
+        }
+        if (fd != -1 && listen(fd, 1) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    volatile std::sig_atomic_t g_stop = 0;
+
+    void on_signal(int) {
+        g_stop = 1;
+    }
+
+    int collect_shared_memory(const std::string& name, const std::string& out_file) {
+        std::ofstream out(out_file, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "failed to open '" << out_file << "'\n";
+            return 1;
+        }
+        tef::Shared_memory_collector collector(name, out);
+        if (!collector.is_open()) {
+            std::cerr << "failed to create shared memory '" << name << "'\n";
+            return 1;
+        }
+        std::signal(SIGINT, on_signal);
+        std::signal(SIGTERM, on_signal);
+        std::cerr << "collecting from shared memory '" << name << "'\n";
+        while (!g_stop && (collector.get_num_finished() == 0 || collector.get_num_attached() > 0)) {
+            if (collector.poll() == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        collector.finish();
+        std::cerr << "wrote '" << out_file << "' from " << collector.get_num_finished() + collector.get_num_attached()
+            << " processes\n";
+        return 0;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " [host:]port out.json\n"
+            << "       " << argv[0] << " unix:path out.json\n"
+            << "       " << argv[0] << " shm:name out.json\n";
+        return 1;
+    }
+    std::string address = argv[1];
+    std::string out_file = argv[2];
+    if (address.compare(0, 4, "shm:") == 0) {
+        return collect_shared_memory(address.substr(4), out_file);
+    }
+    int listener = listen_on(address);
+    if (listener == -1) {
+        std::cerr << "failed to listen on '" << address << "'\n";
+        return 1;
+    }
+    std::cerr << "listening on '" << address << "'\n";
+    int fd;
+    do {
+        fd = accept(listener, nullptr, nullptr);
+    } while (fd == -1 && errno == EINTR);
+    close(listener);
+    if (address.compare(0, 5, "unix:") == 0) {
+        unlink(address.c_str() + 5);
+    }
+    if (fd == -1) {
+        std::cerr << "failed to accept a connection\n";
+        return 1;
+    }
+    std::cerr << "collecting trace\n";
+
+    Socket_buffer buffer(fd);
+    std::istream in(&buffer);
+    bool ok;
+    if (in.peek() == '{') {
+        // spool the JSON, then close it properly if the stream was cut short
+        std::string part_file = out_file + ".part";
+        {
+            std::ofstream part(part_file, std::ios::binary);
+            if (!part.is_open()) {
+                std::cerr << "failed to open '" << part_file << "'\n";
+                close(fd);
+                return 1;
+            }
+            part << in.rdbuf();
+        }
+        std::ifstream part(part_file, std::ios::binary);
+        std::ofstream out(out_file, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "failed to open '" << out_file << "'\n";
+            close(fd);
+            return 1;
+        }
+        ok = tef::recover_json_trace(part, out);
+        part.close();
+        std::remove(part_file.c_str());
+    } else {
+        std::ofstream out(out_file, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "failed to open '" << out_file << "'\n";
+            close(fd);
+            return 1;
+        }
+        // the JSON is closed even if the stream ends early
+        ok = tef::convert_binary_trace(in, out);
+    }
+    close(fd);
+    if (!ok) {
+        std::cerr << "trace stream was truncated or not a teflib trace\n";
+        return 1;
+    }
+    std::cerr << "wrote '" << out_file << "'\n";
+    return 0;
+}
@@ -0,0 +1,48 @@
+// teflib/tools/tef_convert.cpp
+//
+// Converts a binary trace written by tef::Trace_to_binary into TEF JSON
+// which can be loaded into chrome://tracing or https://ui.perfetto.dev.
+// With --recover it instead closes a JSON trace that was never finished,
+// such as the file of a tef::Trace_to_mmap whose process crashed.
+//
+// usage: tef_convert in.tefb out.json
+//        tef_convert --recover in.json out.json
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "trace.h"
+
+int main(int argc, char** argv) {
+    bool recover = argc == 4 && strcmp(argv[1], "--recover") == 0;
+    if (argc != 3 && !recover) {
+        std::cerr << "usage: " << argv[0] << " in.tefb out.json\n"
+            << "       " << argv[0] << " --recover in.json out.json\n";
+        return 1;
+    }
+    const char* in_file = argv[argc - 2];
+    const char* out_file = argv[argc - 1];
+    std::ifstream in(in_file, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "failed to open '" << in_file << "'\n";
+        return 1;
+    }
+    std::ofstream out(out_file, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "failed to open '" << out_file << "'\n";
+        return 1;
+    }
+    if (recover) {
+        if (!tef::recover_json_trace(in, out)) {
+            std::cerr << "'" << in_file << "' is not a JSON trace\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (!tef::convert_binary_trace(in, out)) {
+        std::cerr << "'" << in_file << "' is truncated or not a binary trace\n";
+        return 1;
+    }
+    return 0;
+}